@@ -0,0 +1,96 @@
+#!/bin/sh
+# Runs the same workloads through Blob's batch mode (commands on stdin) and
+# through ed, sed and awk, where installed, and prints throughput ratios.
+# A ratio above 1 means Blob was faster than the other tool.
+#
+# Usage: ./bench.sh [lines...]    (default: 100000 1000000)
+# BENCH_RUNS sets how many times each workload is run, the best time is kept.
+# After the table, each size's Blob 'stats json' (per command timings, from one
+# session running every Blob workload) is printed.
+
+BLOB=${BLOB:-./blob}
+RUNS=${BENCH_RUNS:-3}
+SIZES=${*:-"100000 1000000"}
+
+if [ ! -x "$BLOB" ]; then
+	echo "bench: $BLOB not found, run make first" >&2
+	exit 1
+fi
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+now() {
+	date +%s.%N
+}
+
+# best_of <command...>: runs the command RUNS times on a fresh copy of the corpus, prints the best time
+best_of() {
+	best=""
+	i=0
+	while [ "$i" -lt "$RUNS" ]; do
+		cp "$DIR/corpus" "$DIR/work"
+		start=$(now)
+		"$@" >/dev/null 2>&1
+		end=$(now)
+		best=$(echo "$start $end $best" | awk '{ t = $2 - $1; if ($3 != "" && $3 < t) t = $3; printf "%.6f", t }')
+		i=$((i + 1))
+	done
+	echo "$best"
+}
+
+# The workloads, as the same operation in each tool. Blob has no substitute command yet.
+blob_list() { printf 'l\nq\n' | "$BLOB" "$DIR/work"; }
+blob_save() { printf 'w\nq\n' | "$BLOB" "$DIR/work"; }
+blob_del1() { printf 'd\nw\nq\n' | "$BLOB" "$DIR/work"; }
+blob_wc() { printf 'wc\nq\n' | "$BLOB" "$DIR/work"; }
+
+# blob_stats: runs every Blob workload in one session and prints its 'stats json', without the prompts
+blob_stats() {
+	cp "$DIR/corpus" "$DIR/work"
+	printf 'l\nw\nd\nw\nwc\nstats json\nq\nq\n' | "$BLOB" "$DIR/work" 2>/dev/null |
+		awk '/\[$/ { json = 1; sub(/^.*\[$/, "[") } json { print } /^\]$/ { json = 0 }'
+}
+
+ed_list() { printf ',p\nq\n' | ed -s "$DIR/work"; }
+ed_save() { printf 'w\nq\n' | ed -s "$DIR/work"; }
+ed_del1() { printf '1d\nw\nq\n' | ed -s "$DIR/work"; }
+
+sed_list() { sed -n p "$DIR/work"; }
+sed_save() { sed -i '' "$DIR/work" 2>/dev/null || sed -i "$DIR/work"; }
+sed_del1() { sed -i 1d "$DIR/work"; }
+
+awk_list() { awk 1 "$DIR/work"; }
+awk_save() { awk 1 "$DIR/work" > "$DIR/out" && mv "$DIR/out" "$DIR/work"; }
+awk_del1() { awk 'NR > 1' "$DIR/work" > "$DIR/out" && mv "$DIR/out" "$DIR/work"; }
+awk_wc() { awk '{ w += NF; b += length($0) + 1 } END { print NR, w, b }' "$DIR/work"; }
+
+printf '%-8s %10s %-4s %12s %12s %8s\n' workload lines tool blob_s tool_s ratio
+
+for lines in $SIZES; do
+	awk -v n="$lines" 'BEGIN {
+		srand(1)
+		for (i = 1; i <= n; i++)
+			printf "%d host%d.example.com status=%s latency=%d\n", i, i % 997, (rand() < 0.01 ? "ERROR" : "ok"), rand() * 1000
+	}' > "$DIR/corpus"
+
+	blob_stats > "$DIR/stats.$lines"
+
+	for workload in list save del1 wc; do
+		blob_time=$(best_of "blob_$workload")
+
+		for tool in ed sed awk; do
+			command -v "$tool" >/dev/null 2>&1 || continue
+			command -v "${tool}_$workload" >/dev/null 2>&1 || continue
+
+			tool_time=$(best_of "${tool}_$workload")
+			ratio=$(echo "$blob_time $tool_time" | awk '{ printf "%.2f", ($1 > 0) ? $2 / $1 : 0 }')
+			printf '%-8s %10s %-4s %12s %12s %8s\n' "$workload" "$lines" "$tool" "$blob_time" "$tool_time" "$ratio"
+		done
+	done
+done
+
+for lines in $SIZES; do
+	printf '\nblob stats json, %s lines:\n' "$lines"
+	cat "$DIR/stats.$lines"
+done
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +6,26 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <ctype.h>
+#include <regex.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "blob_plugin.h"
 
 const char *PROMPT = ": ";
 
@@ -16,20 +37,281 @@ struct character {
 
 struct line {
 	struct character *data;
+	size_t len;   /* Number of characters in 'data' */
+	size_t words; /* Whitespace separated words in 'data' */
+	uint64_t hash; /* Of the line's text, two lines with different hashes are never equal */
+	unsigned *refs; /* Lines sharing 'data' (see share_line()), NULL if it isn't shared */
+	struct zone *zone; /* NULL until a search has read it, see zone_absorb() */
+	struct field_block *fields; /* NULL unless the field cache has the line, at 'field_slot' */
+	uint32_t field_slot;
+	size_t number; /* 1-based, only up to date while the line index is valid */
 	struct line *next;
 	struct line *prev;
 };
 
-void *MALLOC(size_t s)
+#ifdef BLOB_HEAP_PROFILE
+/* Allocation site profiling, built with 'make HEAP_PROFILE=1'.
+ * Every block handed out by MALLOC (or adopted from getline()) is tracked by address until FREE.
+ */
+#define HEAP_SITES 256
+#define HEAP_CLASSES 32
+
+struct heap_site {
+	const char *func;
+	int line;
+	unsigned long allocs;
+	unsigned long frees;
+	size_t live; /* Blocks not yet freed */
+	size_t live_bytes;
+	size_t peak_bytes;
+	size_t total_bytes;
+	unsigned long classes[HEAP_CLASSES]; /* Allocations by power of two size class */
+};
+
+struct heap_entry {
+	void *ptr; /* NULL if empty, &heap_tombstone if freed */
+	size_t size;
+	struct heap_site *site;
+};
+
+struct heap_site heap_sites[HEAP_SITES];
+size_t heap_site_count;
+
+/* Worker threads allocate too */
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char heap_tombstone;
+struct heap_entry *heap_table;
+size_t heap_cap;
+size_t heap_used; /* Live entries and tombstones */
+size_t heap_live;
+
+void heap_report(FILE *out, size_t top);
+
+size_t heap_slot(void *ptr)
+{
+	return (size_t) (((uintptr_t) ptr >> 4) * 0x9E3779B97F4A7C15ULL) & (heap_cap - 1);
+}
+
+struct heap_site *heap_site_of(const char *func, int line)
+{
+	struct heap_site *site;
+
+	for (size_t i = 0; i < heap_site_count; i++) {
+		if (heap_sites[i].line == line && heap_sites[i].func == func) {
+			return &heap_sites[i];
+		}
+	}
+
+	/* Out of slots, lump the rest into the last one */
+	if (heap_site_count == HEAP_SITES) {
+		return &heap_sites[HEAP_SITES - 1];
+	}
+
+	site = &heap_sites[heap_site_count++];
+	site->func = func;
+	site->line = line;
+	return site;
+}
+
+void heap_exit()
+{
+	const char *env = getenv("BLOB_HEAP_TOP");
+
+	heap_report(stderr, env != NULL ? strtoul(env, NULL, 10) : 10);
+}
+
+void heap_grow()
+{
+	struct heap_entry *old = heap_table;
+	size_t old_cap = heap_cap;
+	size_t slot;
+
+	if (heap_table == NULL) {
+		(void) atexit(heap_exit);
+	}
+
+	heap_cap = 1024;
+	while (heap_cap < heap_live * 4) {
+		heap_cap *= 2;
+	}
+
+	/* Not through MALLOC, the table must not track itself */
+	heap_table = (struct heap_entry *) calloc(heap_cap, sizeof(struct heap_entry));
+	if (heap_table == NULL) {
+		perror("ed: calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	heap_used = heap_live;
+	for (size_t i = 0; i < old_cap; i++) {
+		if (old[i].ptr == NULL || old[i].ptr == &heap_tombstone) {
+			continue;
+		}
+
+		for (slot = heap_slot(old[i].ptr); heap_table[slot].ptr != NULL; slot = (slot + 1) & (heap_cap - 1));
+		heap_table[slot] = old[i];
+	}
+
+	free(old);
+}
+
+void heap_record(void *ptr, size_t size, const char *func, int line)
+{
+	struct heap_site *site;
+	size_t slot;
+	size_t class;
+
+	if (ptr == NULL) {
+		return ;
+	}
+
+	(void) pthread_mutex_lock(&heap_lock);
+	if ((heap_used + 1) * 2 > heap_cap) {
+		heap_grow();
+	}
+
+	site = heap_site_of(func, line);
+	for (class = 0; class < HEAP_CLASSES - 1 && ((size_t) 1 << class) < size; class++);
+
+	site->allocs++;
+	site->live++;
+	site->live_bytes += size;
+	site->total_bytes += size;
+	site->classes[class]++;
+	if (site->live_bytes > site->peak_bytes) {
+		site->peak_bytes = site->live_bytes;
+	}
+
+	for (slot = heap_slot(ptr); heap_table[slot].ptr != NULL; slot = (slot + 1) & (heap_cap - 1));
+	heap_table[slot].ptr = ptr;
+	heap_table[slot].size = size;
+	heap_table[slot].site = site;
+	heap_used++;
+	heap_live++;
+	(void) pthread_mutex_unlock(&heap_lock);
+}
+
+void heap_forget(void *ptr)
+{
+	struct heap_site *site;
+	size_t slot;
+
+	if (ptr == NULL || heap_table == NULL) {
+		return ;
+	}
+
+	(void) pthread_mutex_lock(&heap_lock);
+	for (slot = heap_slot(ptr); heap_table[slot].ptr != NULL; slot = (slot + 1) & (heap_cap - 1)) {
+		if (heap_table[slot].ptr != ptr) {
+			continue;
+		}
+
+		site = heap_table[slot].site;
+		site->frees++;
+		site->live--;
+		site->live_bytes -= heap_table[slot].size;
+
+		heap_table[slot].ptr = &heap_tombstone;
+		heap_live--;
+		break;
+	}
+	(void) pthread_mutex_unlock(&heap_lock);
+}
+
+int heap_site_cmp(const void *a, const void *b)
+{
+	const struct heap_site *x = *(const struct heap_site **) a;
+	const struct heap_site *y = *(const struct heap_site **) b;
+
+	if (x->live_bytes != y->live_bytes) {
+		return x->live_bytes < y->live_bytes ? 1 : -1;
+	}
+	if (x->peak_bytes != y->peak_bytes) {
+		return x->peak_bytes < y->peak_bytes ? 1 : -1;
+	}
+	return 0;
+}
+
+/* Top 'top' sites by live (then peak) bytes, followed by everything still allocated */
+void heap_report(FILE *out, size_t top)
+{
+	struct heap_site *sorted[HEAP_SITES];
+	size_t class;
+	size_t leaks;
+
+	for (size_t i = 0; i < heap_site_count; i++) {
+		sorted[i] = &heap_sites[i];
+	}
+	qsort(sorted, heap_site_count, sizeof(sorted[0]), heap_site_cmp);
+
+	(void) fprintf(out, "%-28s %10s %10s %10s %12s %12s %12s %8s\n",
+			"site", "allocs", "frees", "live", "live_bytes", "peak_bytes", "total_bytes", "class");
+	for (size_t i = 0; i < heap_site_count && i < top; i++) {
+		/* Most common size class */
+		class = 0;
+		for (size_t c = 1; c < HEAP_CLASSES; c++) {
+			if (sorted[i]->classes[c] > sorted[i]->classes[class]) {
+				class = c;
+			}
+		}
+
+		(void) fprintf(out, "%20s:%-7d %10lu %10lu %10zu %12zu %12zu %12zu %8zu\n",
+				sorted[i]->func, sorted[i]->line, sorted[i]->allocs, sorted[i]->frees, sorted[i]->live,
+				sorted[i]->live_bytes, sorted[i]->peak_bytes, sorted[i]->total_bytes, (size_t) 1 << class);
+	}
+
+	leaks = 0;
+	for (size_t i = 0; i < heap_cap; i++) {
+		if (heap_table[i].ptr == NULL || heap_table[i].ptr == &heap_tombstone) {
+			continue;
+		}
+
+		if (leaks++ < top) {
+			(void) fprintf(out, "leak: %p %zu bytes from %s:%d\n", heap_table[i].ptr,
+					heap_table[i].size, heap_table[i].site->func, heap_table[i].site->line);
+		}
+	}
+
+	if (leaks > top) {
+		(void) fprintf(out, "leak: ... %zu more\n", leaks - top);
+	}
+}
+
+/* Tracks memory malloc()ed on our behalf, like getline() buffers */
+#define HEAP_ADOPT(p, s) heap_record((p), (s), __func__, __LINE__)
+#else
+#define HEAP_ADOPT(p, s) ((void) 0)
+#endif
+
+void *MALLOC_AT(size_t s, const char *func, int line)
 {
 	void *ret = malloc(s);
 	if (ret == NULL) {
 		perror("ed: malloc\n");
 		exit(EXIT_FAILURE);
 	}
+
+#ifdef BLOB_HEAP_PROFILE
+	heap_record(ret, s, func, line);
+#else
+	(void) func;
+	(void) line;
+#endif
 	return ret;
 }
 
+/* Every allocation goes through here, so the heap profiler can see its call site */
+#define MALLOC(s) MALLOC_AT((s), __func__, __LINE__)
+
+void FREE(void *p)
+{
+#ifdef BLOB_HEAP_PROFILE
+	heap_forget(p);
+#endif
+	free(p);
+}
+
 /* Macros for linked list appending, allocating */
 #define ALLOC_LL(t) (t *) MALLOC(sizeof(t));
 #define APPEND_LL(x) \
@@ -44,6 +326,251 @@ void *MALLOC(size_t s)
  */
 sig_atomic_t stop_insertion;
 
+/* Line lengths are bucketed by powers of two: bucket b holds [2^b, 2^(b+1)), bucket 0 holds [0, 2) */
+#define HIST_BUCKETS 16
+
+/* Whole-buffer totals, kept up to date as lines are added and removed so 'wc' is O(1) */
+struct stats {
+	size_t lines;
+	size_t words;
+	size_t bytes; /* As written by 'w', newlines included */
+	size_t longest;
+	size_t longest_count; /* Lines of length 'longest', 0 means it has to be recomputed */
+	size_t hist[HIST_BUCKETS];
+};
+
+
+/* Array view of the buffer, rebuilt on demand after an edit.
+ * bytes[i] and words[i] are prefix sums over lines [0, i), so range queries don't walk the list.
+ */
+struct line_index {
+	struct line **lines;
+	size_t *bytes;
+	size_t *words;
+	size_t count;
+	int valid;
+	unsigned long generation; /* Unique to every rebuild of any buffer's index */
+};
+
+unsigned long index_generations;
+
+/* The last search pattern, and which lines are known to match it */
+struct search_cache {
+	char *pattern;
+	regex_t re;
+	unsigned char *state; /* Per line: 0 not tested yet, 1 no match, 2 match */
+	size_t count;
+	unsigned long generation; /* Of the line index 'state' was filled against */
+	unsigned long serial; /* Numbers each pattern, for the zones' verdicts on it */
+	int literal; /* The pattern has no special characters, so zones can rule lines out */
+	uint64_t bytes[4]; /* Of the literal */
+	uint32_t *bits; /* Bloom filter bits of the literal's trigrams */
+	size_t nbits;
+};
+
+struct search_cache search_cache;
+
+#define UNDO_INSERT 1
+#define UNDO_DELETE 2
+#define UNDO_REVERSE 3
+#define UNDO_ROTATE 4
+
+/* One line inserted or deleted. Ops made this session point at their lines, ops loaded from the sidecar
+ * only know the line number (and the text, for deletes).
+ */
+struct undo_op {
+	unsigned char type;
+	unsigned char group; /* First op of a line of input, 'u' undoes back to here */
+	struct line *line; /* Inserted line, or deleted line owned by the log until it is undone */
+	struct line *prev; /* The line before a deleted line when it was deleted, NULL if it was first */
+	size_t number; /* 1-based, at the time of the op, 0 until written to the sidecar */
+	char *text; /* Deleted text of an op loaded from the sidecar */
+	size_t last; /* Reverses and rotates are of lines 'number' to 'last', by 'shift' for rotates */
+	size_t shift;
+	long offset; /* Of the op's record in the sidecar, if it has been written */
+};
+
+/* The undo history. It is written to a sidecar file next to the buffer's file on 'w', and read back
+ * (only) the first time 'u' runs out of ops, so undo keeps working after Blob is restarted.
+ */
+struct undo_log {
+	struct undo_op *ops;
+	size_t count;
+	size_t cap;
+	size_t persisted; /* ops[0, persisted) are in the sidecar */
+	size_t numbered; /* ops[0, numbered) know their line numbers, a reverse or rotate numbers the ops before it */
+	size_t base; /* Sidecar records that aren't loaded, they come before ops[0] */
+	long truncate_at; /* Persisted ops were undone, the sidecar has to be cut here on the next write, -1 if not */
+	int checked; /* The sidecar's header has been compared against the file */
+	int loaded;
+	int recording;
+	int group_pending;
+};
+
+/* Header of the sidecar, followed by the records: u8 type, u8 group, u64 number, u64 length, text */
+struct undo_header {
+	char magic[8];
+	uint64_t file_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t records;
+};
+
+#define CHECKPOINT_EDITS 100000
+#define CHECKPOINT_COST_FACTOR 50
+
+struct checkpoint {
+	double interval;
+	double last; /* When the last one was started */
+	double cost; /* How long the last one took */
+	unsigned long edits; /* edit_count when the last one was started */
+	pid_t child; /* 0 if none is running */
+};
+
+/* Hash index from a key field to the lines holding it, built by 'index' and kept up to date by edits */
+struct key_entry {
+	uint64_t hash;
+	struct line *line;
+	struct key_entry *next;
+};
+
+struct key_index {
+	char delim;
+	int field; /* 1-based, of 'delim' separated fields */
+	char *json_key; /* Instead of delim/field, the value of this top level key of a JSON object */
+	struct key_entry **buckets;
+	size_t nbuckets; /* A power of two */
+	size_t count;
+};
+
+/* Columnar field cache: where a key index's field (or JSON key) is in each line, and its hash, kept per buffer
+ * after 'index' or 'join' has tokenized the lines so the next of them doesn't have to. One field is cached at a
+ * time, in blocks of FIELD_BLOCK_LINES lines in the order they were stored. A line leaves its block when it is
+ * removed, and a block is freed once all its lines have.
+ */
+#define FIELD_BLOCK_LINES 1024
+#define FIELD_NONE UINT32_MAX /* 'len' of a line without the field */
+#define FIELD_CACHE_MB 256 /* Bound on the cache of each buffer, BLOB_FIELD_CACHE_MB overrides it */
+
+struct field_block {
+	struct line *lines[FIELD_BLOCK_LINES]; /* NULL once removed */
+	uint32_t off[FIELD_BLOCK_LINES];
+	uint32_t len[FIELD_BLOCK_LINES];
+	uint64_t hash[FIELD_BLOCK_LINES];
+	size_t used;
+	size_t live;
+	size_t at; /* In the cache's 'blocks' */
+	struct field_cache *cache;
+};
+
+struct field_cache {
+	char delim;
+	int field;
+	char *json_key;
+	int active; /* Holds the field above */
+	struct field_block **blocks;
+	size_t count;
+	size_t cap;
+	size_t hits; /* Lines a command found in the cache */
+	size_t misses;
+};
+
+/* Zone maps: a summary of each run of up to ZONE_LINES lines (a zone) that a literal search checks before
+ * reading the lines, skipping zones that can't match: a bloom filter of the zone's trigrams and which bytes occur.
+ * Lines join a zone when a search first reads them, next to a neighbour's zone, and leave it when deleted,
+ * so a zone only ever overstates what it holds.
+ */
+#define ZONE_LINES 64
+#define ZONE_TRIGRAMS 4096 /* Closes a zone of long lines early, before its bloom filter fills up */
+#define ZONE_BLOOM_BITS 16384
+
+struct zone {
+	uint64_t bloom[ZONE_BLOOM_BITS / 64]; /* Two bits per trigram */
+	uint64_t bytes[4];
+	size_t lines;
+	size_t trigrams;
+	unsigned long checked; /* The search_cache serial 'may_match' was worked out for */
+	int may_match;
+};
+
+struct zone_map {
+	struct zone **zones;
+	size_t count;
+	size_t cap;
+	size_t skipped; /* Lines a search didn't have to read */
+};
+
+/* An open buffer, 'curbuf' is the one commands act on */
+struct buffer {
+	char *name; /* Switched to with '@name' */
+	char *fname; /* Read from and written to, NULL for scratch buffers like rgrep results */
+	struct line *start;
+	struct line *lines; /* The current line */
+	struct stats stats;
+	unsigned long edit_count; /* Lines added or removed since it was loaded, for pacing checkpoints */
+	struct line_index index;
+	struct line *marks[26]; /* Lines marked with 'kx', addressed as 'x */
+	struct undo_log undo;
+	struct checkpoint checkpoint;
+	struct key_index *keys; /* NULL without an index */
+	struct conf_index *conf; /* NULL until 'get', 'set' or 'unset' */
+	struct zone_map zones;
+	struct field_cache fields;
+	struct buffer *next;
+};
+
+struct buffer *buffers;
+struct buffer *curbuf;
+
+/* Hardware (and page fault) counters sampled around every command when BLOB_PERF is set */
+enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_PAGE_FAULTS,
+	PERF_COUNTERS
+};
+
+const char *perf_names[PERF_COUNTERS] = {
+	"cycles", "instructions", "cache_misses", "branch_misses", "page_faults"
+};
+
+/* -1 if the counter could not be opened */
+int perf_fds[PERF_COUNTERS] = {-1, -1, -1, -1, -1};
+int perf_enabled;
+
+/* Accumulated cost of one command type */
+struct cmd_stats {
+	unsigned long runs;
+	double seconds;
+	uint64_t counters[PERF_COUNTERS];
+};
+
+/* Indexed by the command character, named commands keep theirs in 'struct command' */
+struct cmd_stats char_stats[256];
+
+struct sample {
+	struct timespec start;
+};
+
+/* Cost of the current line of input, written to the slow command log if it took too long */
+struct input_cost {
+	double parse;
+	double io;
+	double wait; /* Blocked on the user (insert mode), not counted as latency */
+	size_t touched; /* Lines moved over, printed, written, added or removed */
+	struct cmd_stats counters;
+} input_cost;
+
+int io_depth;
+double io_started;
+
+/* Set from BLOB_SLOW_LOG, NULL if the slow command log is off */
+const char *slow_log_path;
+double slow_threshold = 0.1;
+long slow_log_max = 1 << 20;
+
 void usage()
 {
         (void) fprintf(stderr,
@@ -58,342 +585,6402 @@ void usage()
 			"'d' (delete): delete the current line.\n"
 			"'q' (quit): quit the editor.\n"
 			"'w' (write): write buffer to file.\n"
+			"'u' (undo): undo the last line of commands that changed the buffer, even from before it was last written.\n"
 			"'h' (help): print this message.\n"
+			"'kx' (mark): mark the current line as x (a-z).\n"
+			"'heap [n]': print the top n allocation sites and live blocks (HEAP_PROFILE=1 builds only).\n"
+			"'stats [json]': print per command timings (and hardware counters if BLOB_PERF=1).\n"
+			"BLOB_SIMD=scalar|sse2|avx2|avx512 limits the vectorized kernels to the given level.\n"
+			"'@name': switch to the buffer called name. 'buffers' lists them, files are named by their path.\n"
+			"'rgrep /re/ [dir]': search the files under dir (default '.') into the buffer @rgrep.\n"
+			"'open [FILE]': open FILE, or the file of the rgrep result on the current line, at its line.\n"
+			"'index -d<c> -f<n>' or 'index -j<key>': index lines by a field (default tab separated) or JSON key.\n"
+			"'key VALUE': go to and print the first line whose indexed key is VALUE.\n"
+			"'join [-l|-v] [-d<c>] @a @b -f<n> -f<m> [> @out]': join a and b on equal fields into buffer out.\n"
+			"'@a & @b', '@a | @b', '@a - @b' [> @out]: lines in both, either, or only a, into buffer out.\n"
+			"'clone @name': copy the buffer into buffer name, sharing its lines. Over a file's buffer, replace its lines.\n"
+			"'get key', 'set key value', 'unset key': read, change or delete a key of an INI (section.key),\n"
+			"    properties or dotenv file, touching only its line.\n"
+			"'follow f1 f2 ...': follow growing files into buffer follow, in timestamp order, until (ctrl+c).\n"
+			"'timehist [/re/] 1m [> @name]': lines per interval (s, m, h, d) of the timestamp where re matches.\n"
+			"'command &' (space before '&'): run command in the background. 'jobs' lists them,\n"
+			"    'wait [n]' and 'kill [n]' finish one.\n"
+			"'[range] plug name args': run the lines of the range (default all) through filter plugin name.so.\n"
+			"'[range] reverse': reverse the lines of the range (default all). '[range] rotate k': rotate them up by k.\n"
+			"    Both take time in the range's length (O(range)): reverse relinks every line, rotate reorders the index.\n"
+			"'recover': load the last background checkpoint (every BLOB_CHECKPOINT_SECS, default 30) after a crash.\n"
+			"Commands slower than BLOB_SLOW_MS (default 100) are logged to BLOB_SLOW_LOG, if set.\n"
+			"'uniq': delete lines equal to the previous line.\n"
+			"'dedup': delete lines equal to any earlier line.\n"
+			"'wc [range]' (word count): print lines, words, bytes, longest line and a line length histogram.\n"
 			"\nYou can string together commands, like so: 'npi' (next, print, insert).\n"
+			"Commands can be preceded by an ed style address, to move there first: a number, '.', '$',\n"
+			"'x (mark), /re/ or ?re? (next/previous match), each followed by +n or -n offsets.\n"
+			"'a,b' and 'a;b' (b counted from a) are ranges, ',' is the whole buffer. After a range,\n"
+			"'p' and 'd' print or delete all of it, like so: '/ERROR/;+50d'.\n"
+			"'[range]~/pattern/k' (fuzzy search): print lines containing pattern with at most k (default 1) errors.\n"
 	);
 }
 
-/* Convert a char array to a line */
-void charray_to_line(struct line *dest, char *src)
+double now()
 {
-	struct character *chars;
-	struct character *idx;
+	struct timespec ts;
 
-	chars = ALLOC_LL(struct character);
-	idx = chars;
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
 
-	for (; *src != '\n' && *src != '\0'; src++) {
-		idx->c = *src;
-		APPEND_LL(idx);
-		idx = idx->next;
+/* Opens the counters if BLOB_PERF is set, falling back to user space only counting if the kernel refuses */
+void perf_init()
+{
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[PERF_COUNTERS] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+		{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+	};
+	struct perf_event_attr attr;
+	const char *env;
+
+	env = getenv("BLOB_PERF");
+	if (env == NULL || *env == '\0' || strcmp(env, "0") == 0) {
+		return ;
 	}
 
-	if ((*src == '\n') || (*src == '\0')) {
-		idx->c = ' ';
-		idx->next = NULL;
-	} else {
-		idx = idx->prev;
-		free(idx->next);
-		idx->next = NULL;
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		(void) memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.disabled = 1;
+
+		perf_fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (perf_fds[i] < 0 && (errno == EACCES || errno == EPERM)) {
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			perf_fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+
+		if (perf_fds[i] >= 0) {
+			perf_enabled = 1;
+		}
 	}
 
-	dest->data = chars;
+	if (!perf_enabled) {
+		perror("ed: perf_event_open");
+	}
 }
 
-/* Convert a line to a char array */
-char *lines_to_charray(struct line *line)
+void sample_begin(struct sample *sample)
 {
-	struct character *chars;
-	struct character *idx;
-	
-	char *buffer;
-	size_t buffer_size = 0;
-	
-	chars = line->data;
-	idx = chars;
+	if (perf_enabled) {
+		for (int i = 0; i < PERF_COUNTERS; i++) {
+			if (perf_fds[i] >= 0) {
+				(void) ioctl(perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+				(void) ioctl(perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+	}
 
-	while (idx != NULL) {
-		buffer_size++;
-		idx = idx->next;
+	(void) clock_gettime(CLOCK_MONOTONIC, &sample->start);
+}
+
+void sample_end(struct sample *sample, struct cmd_stats *stats)
+{
+	struct timespec end;
+	uint64_t value;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (perf_enabled) {
+		for (int i = 0; i < PERF_COUNTERS; i++) {
+			if (perf_fds[i] < 0) {
+				continue;
+			}
+
+			(void) ioctl(perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+			if (read(perf_fds[i], &value, sizeof(value)) == sizeof(value)) {
+				stats->counters[i] += value;
+				input_cost.counters.counters[i] += value;
+			}
+		}
 	}
 
-	buffer = (char *) MALLOC(buffer_size + 2);
-	idx = chars;
+	stats->runs++;
+	stats->seconds += (double) (end.tv_sec - sample->start.tv_sec) +
+		(double) (end.tv_nsec - sample->start.tv_nsec) / 1e9;
+	input_cost.counters.runs++;
+}
 
-	for (size_t i = 0; idx != NULL; i++) {
-		buffer[i] = (char) idx->c;
-		idx = idx->next;
+/* Time spent between io_begin() and io_end() counts as I/O, nested calls are only counted once */
+void io_begin()
+{
+	if (io_depth++ == 0) {
+		io_started = now();
 	}
+}
 
-	buffer[buffer_size] = '\n';
-	buffer[buffer_size + 1] = '\0';
-	return buffer;
+void io_end()
+{
+	if (--io_depth == 0) {
+		input_cost.io += now() - io_started;
+	}
 }
 
-FILE *create_empty_file(const char *fname)
+/* Vectorized kernels come in scalar, SSE2, AVX2 and AVX-512 variants.
+ * simd_init() picks the best one the CPU supports, BLOB_SIMD=scalar|sse2|avx2|avx512 forces a lower level.
+ */
+enum simd_level {
+	SIMD_SCALAR,
+	SIMD_SSE2,
+	SIMD_AVX2,
+	SIMD_AVX512,
+	SIMD_LEVELS
+};
+
+const char *simd_names[SIMD_LEVELS] = {"scalar", "sse2", "avx2", "avx512"};
+enum simd_level simd_level;
+
+/* Length of 's' up to the first newline or NUL, and the number of whitespace separated words in it */
+typedef size_t (*scan_line_fn)(const char *s, size_t *words);
+
+/* First occurrence of 'needle' in the 'len' bytes at 's', NULL if there is none */
+typedef const char *(*find_literal_fn)(const char *s, size_t len, const char *needle, size_t needle_len);
+
+struct kernels {
+	scan_line_fn scan_line;
+	find_literal_fn find_literal;
+};
+
+struct kernels kernels;
+
+size_t scan_line_scalar(const char *s, size_t *words)
 {
-	FILE *create_file;
+	size_t len;
+	int in_word;
 
-	create_file = fopen(fname, "w+");
-	if (create_file == NULL) {
-		perror("ed: create_empty_file");
-		exit(EXIT_FAILURE);
+	*words = 0;
+	in_word = 0;
+	for (len = 0; s[len] != '\n' && s[len] != '\0'; len++) {
+		if (isspace((unsigned char) s[len])) {
+			in_word = 0;
+		} else if (!in_word) {
+			in_word = 1;
+			(*words)++;
+		}
+	}
+
+	return len;
+}
+
+const char *find_literal_scalar(const char *s, size_t len, const char *needle, size_t needle_len)
+{
+	return (const char *) memmem(s, len, needle, needle_len);
+}
+
+#if defined(__x86_64__)
+/* Folds one block's byte masks (bit i is byte i) into the word count.
+ * Returns the terminator's position, or 'width' if the block has none.
+ */
+static inline unsigned scan_masks(uint64_t space, uint64_t term, unsigned width, uint64_t *in_word, size_t *words)
+{
+	unsigned n;
+	uint64_t valid;
+	uint64_t text;
+
+	n = term != 0 ? (unsigned) __builtin_ctzll(term) : width;
+	valid = n >= 64 ? ~0ULL : (1ULL << n) - 1;
+	text = ~space & valid;
+
+	*words += (size_t) __builtin_popcountll(text & ~((text << 1) | *in_word));
+	*in_word = (text >> (width - 1)) & 1;
+	return n;
+}
+
+/* The loads are aligned so they never cross into an unmapped page past the terminator. They do read bytes around
+ * the string that aren't its own (within the same page), which AddressSanitizer would report, so it is off for these.
+ */
+__attribute__((target("sse2"), no_sanitize_address))
+size_t scan_line_sse2(const char *s, size_t *words)
+{
+	const char *p = (const char *) ((uintptr_t) s & ~(uintptr_t) 15);
+	unsigned skip = (unsigned) (s - p);
+	uint64_t in_word = 0;
+	uint64_t space;
+	uint64_t term;
+	size_t len = 0;
+	unsigned n;
+	__m128i v;
+	__m128i ctrl;
+
+	*words = 0;
+	for (;; p += 16) {
+		v = _mm_load_si128((const __m128i *) p);
+		term = (uint16_t) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+					_mm_cmpeq_epi8(v, _mm_setzero_si128())));
+		/* '\t' through '\r' are the bytes where (c - 9) <= 4 unsigned */
+		ctrl = _mm_sub_epi8(v, _mm_set1_epi8(9));
+		space = (uint16_t) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+					_mm_cmpeq_epi8(_mm_min_epu8(ctrl, _mm_set1_epi8(4)), ctrl)));
+
+		n = scan_masks(space >> skip, term >> skip, 16 - skip, &in_word, words);
+		len += n;
+		if (n < 16 - skip) {
+			return len;
+		}
+		skip = 0;
+	}
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+size_t scan_line_avx2(const char *s, size_t *words)
+{
+	const char *p = (const char *) ((uintptr_t) s & ~(uintptr_t) 31);
+	unsigned skip = (unsigned) (s - p);
+	uint64_t in_word = 0;
+	uint64_t space;
+	uint64_t term;
+	size_t len = 0;
+	unsigned n;
+	__m256i v;
+	__m256i ctrl;
+
+	*words = 0;
+	for (;; p += 32) {
+		v = _mm256_load_si256((const __m256i *) p);
+		term = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+					_mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+		ctrl = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+		space = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+					_mm256_cmpeq_epi8(_mm256_min_epu8(ctrl, _mm256_set1_epi8(4)), ctrl)));
+
+		n = scan_masks(space >> skip, term >> skip, 32 - skip, &in_word, words);
+		len += n;
+		if (n < 32 - skip) {
+			return len;
+		}
+		skip = 0;
+	}
+}
+
+__attribute__((target("avx512f,avx512bw"), no_sanitize_address))
+size_t scan_line_avx512(const char *s, size_t *words)
+{
+	const char *p = (const char *) ((uintptr_t) s & ~(uintptr_t) 63);
+	unsigned skip = (unsigned) (s - p);
+	uint64_t in_word = 0;
+	uint64_t space;
+	uint64_t term;
+	size_t len = 0;
+	unsigned n;
+	__m512i v;
+
+	*words = 0;
+	for (;; p += 64) {
+		v = _mm512_load_si512((const void *) p);
+		term = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\n')) | _mm512_cmpeq_epi8_mask(v, _mm512_setzero_si512());
+		space = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(' ')) |
+			_mm512_cmple_epu8_mask(_mm512_sub_epi8(v, _mm512_set1_epi8(9)), _mm512_set1_epi8(4));
+
+		n = scan_masks(space >> skip, term >> skip, 64 - skip, &in_word, words);
+		len += n;
+		if (n < 64 - skip) {
+			return len;
+		}
+		skip = 0;
+	}
+}
+
+/* Compares the needle's first and last bytes at 16 positions at once, and only the whole needle where both match.
+ * The loads stay inside the 'len' bytes, memmem() takes the tail.
+ */
+__attribute__((target("sse2")))
+const char *find_literal_sse2(const char *s, size_t len, const char *needle, size_t needle_len)
+{
+	__m128i first;
+	__m128i last;
+	unsigned mask;
+	size_t i;
+
+	if (needle_len == 0 || needle_len > len) {
+		return needle_len == 0 ? s : NULL;
+	}
+
+	first = _mm_set1_epi8(needle[0]);
+	last = _mm_set1_epi8(needle[needle_len - 1]);
+	for (i = 0; i + needle_len - 1 + 16 <= len; i += 16) {
+		mask = (unsigned) _mm_movemask_epi8(_mm_and_si128(
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (s + i)), first),
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (s + i + needle_len - 1)), last)));
+		for (; mask != 0; mask &= mask - 1) {
+			if (memcmp(s + i + __builtin_ctz(mask), needle, needle_len) == 0) {
+				return s + i + __builtin_ctz(mask);
+			}
+		}
+	}
+
+	return (const char *) memmem(s + i, len - i, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+const char *find_literal_avx2(const char *s, size_t len, const char *needle, size_t needle_len)
+{
+	__m256i first;
+	__m256i last;
+	unsigned mask;
+	size_t i;
+
+	if (needle_len == 0 || needle_len > len) {
+		return needle_len == 0 ? s : NULL;
+	}
+
+	first = _mm256_set1_epi8(needle[0]);
+	last = _mm256_set1_epi8(needle[needle_len - 1]);
+	for (i = 0; i + needle_len - 1 + 32 <= len; i += 32) {
+		mask = (unsigned) _mm256_movemask_epi8(_mm256_and_si256(
+					_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (s + i)), first),
+					_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (s + i + needle_len - 1)), last)));
+		for (; mask != 0; mask &= mask - 1) {
+			if (memcmp(s + i + __builtin_ctz(mask), needle, needle_len) == 0) {
+				return s + i + __builtin_ctz(mask);
+			}
+		}
+	}
+
+	return (const char *) memmem(s + i, len - i, needle, needle_len);
+}
+#endif
+
+/* Detects the CPU's features once and binds the kernels */
+void simd_init()
+{
+	enum simd_level supported = SIMD_SCALAR;
+	const char *env;
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		supported = SIMD_SSE2;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		supported = SIMD_AVX2;
+	}
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+		supported = SIMD_AVX512;
+	}
+#endif
+
+	simd_level = supported;
+
+	env = getenv("BLOB_SIMD");
+	if (env != NULL && *env != '\0') {
+		for (int i = 0; i < SIMD_LEVELS; i++) {
+			if (strcmp(env, simd_names[i]) == 0) {
+				simd_level = (enum simd_level) i;
+			}
+		}
+
+		if (simd_level > supported) {
+			(void) fprintf(stderr, "ed: BLOB_SIMD=%s not supported, using %s\n", env, simd_names[supported]);
+			simd_level = supported;
+		}
+	}
+
+	kernels.scan_line = scan_line_scalar;
+	kernels.find_literal = find_literal_scalar;
+#if defined(__x86_64__)
+	/* find_literal has no AVX-512 variant, the AVX2 one does as well there */
+	switch (simd_level) {
+		case SIMD_SSE2:; {kernels.scan_line = scan_line_sse2; kernels.find_literal = find_literal_sse2; break;}
+		case SIMD_AVX2:; {kernels.scan_line = scan_line_avx2; kernels.find_literal = find_literal_avx2; break;}
+		case SIMD_AVX512:; {kernels.scan_line = scan_line_avx512; kernels.find_literal = find_literal_avx2; break;}
+		default:; {break;}
+	}
+#endif
+}
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+	acc += input * HASH_PRIME2;
+	acc = (acc << 31) | (acc >> 33);
+	return acc * HASH_PRIME1;
+}
+
+/* 64-bit hash of 'len' bytes, eight at a time, in the style of xxh64 */
+uint64_t hash_bytes(const char *s, size_t len)
+{
+	uint64_t h = HASH_PRIME3 + len;
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		(void) memcpy(&word, s + i, sizeof(word));
+		h ^= hash_round(0, word);
+		h = ((h << 27) | (h >> 37)) * HASH_PRIME1 + HASH_PRIME3;
+	}
+
+	for (; i < len; i++) {
+		h ^= (unsigned char) s[i] * HASH_PRIME3;
+		h = ((h << 11) | (h >> 53)) * HASH_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	h *= HASH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/* Worker threads, BLOB_THREADS or one per online CPU */
+#define MAX_WORKERS 64
+
+typedef void (*parallel_fn)(void *ctx, size_t begin, size_t end);
+
+struct parallel_chunk {
+	parallel_fn fn;
+	void *ctx;
+	size_t begin;
+	size_t end;
+};
+
+size_t worker_count()
+{
+	static size_t workers;
+	const char *env;
+	long cpus;
+
+	if (workers == 0) {
+		env = getenv("BLOB_THREADS");
+		cpus = env != NULL ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : (size_t) cpus;
+	}
+
+	return workers;
+}
+
+void *parallel_worker(void *arg)
+{
+	struct parallel_chunk *chunk = (struct parallel_chunk *) arg;
+
+	chunk->fn(chunk->ctx, chunk->begin, chunk->end);
+	return NULL;
+}
+
+/* Splits [0, n) into one chunk per worker and runs 'fn' on them in parallel.
+ * Ranges under 'min_chunk' per worker (or when threads can't be made) run on the calling thread.
+ */
+void parallel_for(size_t n, size_t min_chunk, parallel_fn fn, void *ctx)
+{
+	struct parallel_chunk chunks[MAX_WORKERS];
+	pthread_t threads[MAX_WORKERS];
+	int started[MAX_WORKERS];
+	size_t workers;
+	size_t step;
+
+	workers = worker_count();
+	if (min_chunk == 0) {
+		min_chunk = 1;
+	}
+	if (workers > n / min_chunk) {
+		workers = n / min_chunk;
+	}
+	if (workers <= 1) {
+		fn(ctx, 0, n);
+		return ;
+	}
+
+	step = (n + workers - 1) / workers;
+	for (size_t i = 0; i < workers; i++) {
+		chunks[i].fn = fn;
+		chunks[i].ctx = ctx;
+		chunks[i].begin = i * step < n ? i * step : n;
+		chunks[i].end = (i + 1) * step < n ? (i + 1) * step : n;
+	}
+
+	/* The first chunk is ours */
+	for (size_t i = 1; i < workers; i++) {
+		started[i] = pthread_create(&threads[i], NULL, parallel_worker, &chunks[i]) == 0;
+	}
+	fn(ctx, chunks[0].begin, chunks[0].end);
+
+	for (size_t i = 1; i < workers; i++) {
+		if (started[i]) {
+			(void) pthread_join(threads[i], NULL);
+		} else {
+			fn(ctx, chunks[i].begin, chunks[i].end);
+		}
+	}
+}
+
+/* Convert a char array to a line */
+void charray_to_line(struct line *dest, char *src)
+{
+	struct character *chars;
+	struct character *idx;
+
+	size_t len;
+	size_t words;
+
+	chars = ALLOC_LL(struct character);
+	idx = chars;
+
+	/* The newline scan also gathers the per-line counts for 'wc' */
+	len = kernels.scan_line(src, &words);
+	dest->hash = hash_bytes(src, len);
+	for (size_t i = 0; i < len; i++) {
+		idx->c = src[i];
+		APPEND_LL(idx);
+		idx = idx->next;
+	}
+	src += len;
+
+	if ((*src == '\n') || (*src == '\0')) {
+		idx->c = ' ';
+		idx->next = NULL;
+		len++;
+	} else {
+		idx = idx->prev;
+		FREE(idx->next);
+		idx->next = NULL;
+	}
+
+	dest->data = chars;
+	dest->len = len;
+	dest->words = words;
+	dest->refs = NULL;
+	dest->zone = NULL;
+	dest->fields = NULL;
+}
+
+/* Compares the cached hashes first, and only walks the characters if they match */
+int lines_equal(struct line *a, struct line *b)
+{
+	struct character *x;
+	struct character *y;
+
+	if (a->hash != b->hash || a->len != b->len) {
+		return 0;
+	}
+
+	if (a->data == b->data) {
+		return 1;
+	}
+
+	for (x = a->data, y = b->data; x != NULL && y != NULL; x = x->next, y = y->next) {
+		if (x->c != y->c) {
+			return 0;
+		}
+	}
+
+	return x == NULL && y == NULL;
+}
+
+size_t hist_bucket(size_t len)
+{
+	size_t bucket = 0;
+
+	while (len > 1 && bucket < HIST_BUCKETS - 1) {
+		len >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+/* Copies the text of 'line' into a reusable buffer, without the space charray_to_line pads every line with */
+const char *line_text(struct line *line, char **buf, size_t *cap)
+{
+	struct character *c;
+	size_t i;
+
+	if (*cap < line->len + 1) {
+		FREE(*buf);
+		*cap = line->len + 1;
+		*buf = (char *) MALLOC(*cap);
+	}
+
+	for (i = 0, c = line->data; c != NULL && i + 1 < line->len; i++, c = c->next) {
+		(*buf)[i] = (char) c->c;
+	}
+	(*buf)[i] = '\0';
+
+	return *buf;
+}
+
+/* Finds the key of 'text' (of length 'len'): the value of a top level "name": in a JSON object,
+ * or the given field. Returns 0 if the line doesn't have one.
+ */
+int find_key(struct key_index *keys, const char *text, size_t len, const char **key, size_t *key_len)
+{
+	const char *end = text + len;
+	const char *p;
+	size_t name_len;
+	int depth;
+	int field;
+
+	if (keys->json_key == NULL) {
+		for (field = 1, p = text; field < keys->field; p++) {
+			p = (const char *) memchr(p, keys->delim, (size_t) (end - p));
+			if (p == NULL) {
+				return 0;
+			}
+			field++;
+		}
+
+		*key = p;
+		p = (const char *) memchr(p, keys->delim, (size_t) (end - p));
+		*key_len = (size_t) ((p != NULL ? p : end) - *key);
+		return 1;
+	}
+
+	name_len = strlen(keys->json_key);
+	depth = 0;
+	for (p = text; p < end; p++) {
+		if (*p == '{' || *p == '[') {
+			depth++;
+		} else if (*p == '}' || *p == ']') {
+			depth--;
+		} else if (*p == '"') {
+			/* A string: a key if it's ours, at the top level, and followed by ':' */
+			const char *str = ++p;
+			while (p < end && *p != '"') {
+				p += *p == '\\' ? 2 : 1;
+			}
+			if (p >= end) {
+				return 0;
+			}
+
+			if (depth != 1 || (size_t) (p - str) != name_len || memcmp(str, keys->json_key, name_len) != 0) {
+				continue;
+			}
+
+			for (p++; p < end && isspace((unsigned char) *p); p++);
+			if (p >= end || *p != ':') {
+				continue;
+			}
+			for (p++; p < end && isspace((unsigned char) *p); p++);
+
+			if (p < end && *p == '"') {
+				*key = ++p;
+				while (p < end && *p != '"') {
+					p += *p == '\\' ? 2 : 1;
+				}
+				*key_len = (size_t) ((p < end ? p : end) - *key);
+			} else {
+				*key = p;
+				while (p < end && *p != ',' && *p != '}' && !isspace((unsigned char) *p)) {
+					p++;
+				}
+				*key_len = (size_t) (p - *key);
+			}
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* The key of 'line', copied out into a caller owned scratch buffer */
+int line_key(struct key_index *keys, struct line *line, char **buf, size_t *cap, const char **key, size_t *key_len)
+{
+	const char *text = line_text(line, buf, cap);
+
+	return find_key(keys, text, line->len - 1, key, key_len);
+}
+
+int field_cache_holds(struct field_cache *cache, struct key_index *keys)
+{
+	if (!cache->active || (cache->json_key == NULL) != (keys->json_key == NULL)) {
+		return 0;
+	}
+
+	if (keys->json_key != NULL) {
+		return strcmp(cache->json_key, keys->json_key) == 0;
+	}
+
+	return cache->delim == keys->delim && cache->field == keys->field;
+}
+
+/* Drops every cached line, the lines must still be there */
+void field_cache_reset(struct field_cache *cache)
+{
+	struct field_block *block;
+
+	for (size_t i = 0; i < cache->count; i++) {
+		block = cache->blocks[i];
+		for (size_t slot = 0; slot < block->used; slot++) {
+			if (block->lines[slot] != NULL) {
+				block->lines[slot]->fields = NULL;
+			}
+		}
+		FREE(block);
+	}
+
+	FREE(cache->blocks);
+	FREE(cache->json_key);
+	(void) memset(cache, 0, sizeof(*cache));
+}
+
+/* Takes 'line' out of its block, freeing the block if it was the last line in it */
+void field_cache_detach(struct line *line)
+{
+	struct field_block *block = line->fields;
+	struct field_cache *cache;
+
+	if (block == NULL) {
+		return ;
+	}
+
+	block->lines[line->field_slot] = NULL;
+	line->fields = NULL;
+	if (--block->live != 0) {
+		return ;
+	}
+
+	cache = block->cache;
+	cache->blocks[block->at] = cache->blocks[--cache->count];
+	cache->blocks[block->at]->at = block->at;
+	FREE(block);
+}
+
+/* Where the key of 'line' is in its text, and its hash: from the cache if it has the line, otherwise worked out
+ * (and *cached set to 0, for field_cache_store()). Returns 0 if the line has no key. Safe in the worker threads.
+ */
+int field_key(struct field_cache *cache, struct key_index *keys, struct line *line, char **buf, size_t *cap,
+		size_t *off, size_t *len, uint64_t *hash, int *cached)
+{
+	struct field_block *block = line->fields;
+	const char *text;
+	const char *key;
+
+	if (block != NULL && block->cache == cache && field_cache_holds(cache, keys)) {
+		*cached = 1;
+		if (block->len[line->field_slot] == FIELD_NONE) {
+			return 0;
+		}
+		*off = block->off[line->field_slot];
+		*len = block->len[line->field_slot];
+		*hash = block->hash[line->field_slot];
+		return 1;
+	}
+
+	*cached = 0;
+	text = line_text(line, buf, cap);
+	if (!find_key(keys, text, line->len - 1, &key, len)) {
+		return 0;
+	}
+	*off = (size_t) (key - text);
+	*hash = hash_bytes(key, *len);
+	return 1;
+}
+
+/* Caches what field_key() worked out for 'line', which is in the buffer owning 'cache'. A cache holding another
+ * field starts over with this one, a full one keeps what it has.
+ */
+void field_cache_store(struct field_cache *cache, struct key_index *keys, struct line *line, int has_key,
+		size_t off, size_t len, uint64_t hash)
+{
+	static size_t max_blocks;
+	struct field_block *block;
+	struct field_block **grown;
+	const char *env;
+
+	if (max_blocks == 0) {
+		env = getenv("BLOB_FIELD_CACHE_MB");
+		max_blocks = (size_t) (env != NULL ? strtol(env, NULL, 10) : FIELD_CACHE_MB) * 1024 * 1024 /
+				sizeof(struct field_block);
+		max_blocks = max_blocks < 1 ? 1 : max_blocks;
+	}
+
+	if (!field_cache_holds(cache, keys)) {
+		field_cache_reset(cache);
+		cache->active = 1;
+		cache->delim = keys->delim;
+		cache->field = keys->field;
+		if (keys->json_key != NULL) {
+			cache->json_key = (char *) MALLOC(strlen(keys->json_key) + 1);
+			(void) strcpy(cache->json_key, keys->json_key);
+		}
+	}
+
+	if (line->fields != NULL) {
+		cache->hits++;
+		return ;
+	}
+	cache->misses++;
+
+	if (has_key && (off >= FIELD_NONE || len >= FIELD_NONE)) {
+		return ;
+	}
+
+	block = cache->count != 0 ? cache->blocks[cache->count - 1] : NULL;
+	if (block == NULL || block->used == FIELD_BLOCK_LINES) {
+		if (cache->count == max_blocks) {
+			return ;
+		}
+
+		if (cache->count == cache->cap) {
+			cache->cap = cache->cap == 0 ? 64 : cache->cap * 2;
+			grown = (struct field_block **) MALLOC(cache->cap * sizeof(struct field_block *));
+			if (cache->count != 0) {
+				(void) memcpy(grown, cache->blocks, cache->count * sizeof(struct field_block *));
+			}
+			FREE(cache->blocks);
+			cache->blocks = grown;
+		}
+
+		block = ALLOC_LL(struct field_block);
+		block->used = 0;
+		block->live = 0;
+		block->at = cache->count;
+		block->cache = cache;
+		cache->blocks[cache->count++] = block;
+	}
+
+	block->lines[block->used] = line;
+	block->off[block->used] = (uint32_t) off;
+	block->len[block->used] = has_key ? (uint32_t) len : FIELD_NONE;
+	block->hash[block->used] = hash;
+	line->fields = block;
+	line->field_slot = (uint32_t) block->used;
+	block->used++;
+	block->live++;
+}
+
+/* The keys of many lines of one buffer, worked out by the worker threads and then cached */
+struct field_scan {
+	struct field_cache *cache;
+	struct key_index *keys;
+	struct line **lines;
+	size_t count;
+	unsigned char *has_key;
+	size_t *offs;
+	size_t *lens;
+	uint64_t *hashes;
+	unsigned char *cached;
+};
+
+void field_scan_chunk(void *ctx, size_t begin, size_t end)
+{
+	struct field_scan *scan = (struct field_scan *) ctx;
+	size_t cap = 0;
+	char *buf = NULL;
+	int cached;
+
+	for (size_t i = begin; i < end; i++) {
+		scan->has_key[i] = (unsigned char) field_key(scan->cache, scan->keys, scan->lines[i], &buf, &cap,
+				&scan->offs[i], &scan->lens[i], &scan->hashes[i], &cached);
+		scan->cached[i] = (unsigned char) cached;
+		if (!scan->has_key[i]) {
+			scan->offs[i] = scan->lens[i] = 0;
+			scan->hashes[i] = 0;
+		}
+	}
+
+	FREE(buf);
+}
+
+/* Fills in the key of every line of 'scan', in parallel, and caches the ones that weren't */
+void field_scan_run(struct field_scan *scan)
+{
+	scan->has_key = (unsigned char *) MALLOC(scan->count + 1);
+	scan->offs = (size_t *) MALLOC((scan->count + 1) * sizeof(size_t));
+	scan->lens = (size_t *) MALLOC((scan->count + 1) * sizeof(size_t));
+	scan->hashes = (uint64_t *) MALLOC((scan->count + 1) * sizeof(uint64_t));
+	scan->cached = (unsigned char *) MALLOC(scan->count + 1);
+
+	parallel_for(scan->count, 65536, field_scan_chunk, scan);
+
+	for (size_t i = 0; i < scan->count; i++) {
+		if (scan->cached[i]) {
+			scan->cache->hits++;
+		} else {
+			field_cache_store(scan->cache, scan->keys, scan->lines[i], scan->has_key[i], scan->offs[i],
+					scan->lens[i], scan->hashes[i]);
+		}
+	}
+}
+
+void field_scan_free(struct field_scan *scan)
+{
+	FREE(scan->has_key);
+	FREE(scan->offs);
+	FREE(scan->lens);
+	FREE(scan->hashes);
+	FREE(scan->cached);
+}
+
+/* Copies 'len' characters of 'line' from 'off' on, without copying out the rest of the line */
+void line_copy(struct line *line, size_t off, size_t len, char *dest)
+{
+	struct character *c = line->data;
+
+	for (size_t i = 0; c != NULL && i < off; i++, c = c->next);
+	for (size_t i = 0; c != NULL && i < len; i++, c = c->next) {
+		dest[i] = (char) c->c;
+	}
+}
+
+void key_index_insert(struct key_index *keys, struct line *line, uint64_t hash)
+{
+	struct key_entry *entry;
+	struct key_entry **tail;
+	struct key_entry **grown;
+	size_t slot;
+
+	/* Keep about one entry per bucket */
+	if (keys->count >= keys->nbuckets) {
+		grown = (struct key_entry **) MALLOC(keys->nbuckets * 2 * sizeof(struct key_entry *));
+		(void) memset(grown, 0, keys->nbuckets * 2 * sizeof(struct key_entry *));
+
+		/* Walking each chain in order and appending keeps lines with equal keys in buffer order */
+		for (size_t i = 0; i < keys->nbuckets; i++) {
+			while (keys->buckets[i] != NULL) {
+				entry = keys->buckets[i];
+				keys->buckets[i] = entry->next;
+
+				for (tail = &grown[entry->hash & (keys->nbuckets * 2 - 1)]; *tail != NULL; tail = &(*tail)->next);
+				entry->next = NULL;
+				*tail = entry;
+			}
+		}
+
+		FREE(keys->buckets);
+		keys->buckets = grown;
+		keys->nbuckets *= 2;
+	}
+
+	entry = ALLOC_LL(struct key_entry);
+	entry->hash = hash;
+	entry->line = line;
+	entry->next = NULL;
+
+	slot = hash & (keys->nbuckets - 1);
+	for (tail = &keys->buckets[slot]; *tail != NULL; tail = &(*tail)->next);
+	*tail = entry;
+	keys->count++;
+}
+
+/* Keeps the current buffer's key index up to date as 'line' comes or goes */
+void key_index_update(struct line *line, int added)
+{
+	static char *buf;
+	static size_t cap;
+	struct key_index *keys = curbuf->keys;
+	struct key_entry **link;
+	struct key_entry *entry;
+	size_t off;
+	size_t len;
+	uint64_t hash;
+	int has_key;
+	int cached;
+
+	if (keys == NULL) {
+		return ;
+	}
+
+	has_key = field_key(&curbuf->fields, keys, line, &buf, &cap, &off, &len, &hash, &cached);
+	if (added && !cached) {
+		field_cache_store(&curbuf->fields, keys, line, has_key, off, len, hash);
+	}
+	if (!has_key) {
+		return ;
+	}
+
+	if (added) {
+		key_index_insert(keys, line, hash);
+		return ;
+	}
+
+	for (link = &keys->buckets[hash & (keys->nbuckets - 1)]; *link != NULL; link = &(*link)->next) {
+		if ((*link)->line == line) {
+			entry = *link;
+			*link = entry->next;
+			FREE(entry);
+			keys->count--;
+			return ;
+		}
+	}
+}
+
+void destroy_keys(struct key_index *keys)
+{
+	struct key_entry *entry;
+
+	if (keys == NULL) {
+		return ;
+	}
+
+	for (size_t i = 0; i < keys->nbuckets; i++) {
+		while (keys->buckets[i] != NULL) {
+			entry = keys->buckets[i];
+			keys->buckets[i] = entry->next;
+			FREE(entry);
+		}
+	}
+
+	FREE(keys->buckets);
+	FREE(keys->json_key);
+	FREE(keys);
+}
+
+/* Parses an INI, properties or dotenv line. Returns CONF_KEY for 'key = value' (with the key and value trimmed,
+ * and dotenv's 'export ' skipped), CONF_SECTION for '[name]' (with the name in key), 0 for anything else.
+ */
+#define CONF_KEY 1
+#define CONF_SECTION 2
+
+int conf_parse(const char *text, size_t len, const char **key, size_t *key_len, const char **value, size_t *value_len)
+{
+	const char *end = text + len;
+	const char *p = text;
+	const char *sep;
+
+	while (p < end && isspace((unsigned char) *p)) {
+		p++;
+	}
+	while (end > p && isspace((unsigned char) end[-1])) {
+		end--;
+	}
+	if (p == end || *p == '#' || *p == ';' || *p == '!') {
+		return 0;
+	}
+
+	if (*p == '[') {
+		if (end[-1] != ']' || end - p < 2) {
+			return 0;
+		}
+		for (p++, end--; p < end && isspace((unsigned char) *p); p++);
+		while (end > p && isspace((unsigned char) end[-1])) {
+			end--;
+		}
+		*key = p;
+		*key_len = (size_t) (end - p);
+		return CONF_SECTION;
+	}
+
+	if ((size_t) (end - p) > 7 && strncmp(p, "export", 6) == 0 && isspace((unsigned char) p[6])) {
+		for (p += 6; p < end && isspace((unsigned char) *p); p++);
+	}
+
+	for (sep = p; sep < end && *sep != '=' && *sep != ':'; sep++);
+	if (sep == end || sep == p) {
+		return 0;
+	}
+
+	*key = p;
+	for (*key_len = (size_t) (sep - p); *key_len > 0 && isspace((unsigned char) p[*key_len - 1]); (*key_len)--);
+
+	for (p = sep + 1; p < end && isspace((unsigned char) *p); p++);
+	*value = p;
+	*value_len = (size_t) (end - p);
+	return CONF_KEY;
+}
+
+/* Index from keys of INI, properties or dotenv files to their lines, built by the first 'get', 'set' or 'unset'.
+ * Edits of key lines update it as they happen. Each entry knows its section by the header line; adding or
+ * removing a header moves lines between sections, so that makes the next lookup rebuild it.
+ */
+struct conf_entry {
+	uint64_t hash; /* Of the key */
+	struct line *line;
+	struct line *section; /* Header line, NULL before the first one */
+	struct conf_entry *next;
+};
+
+struct conf_index {
+	struct conf_entry **buckets;
+	size_t nbuckets; /* A power of two */
+	size_t count;
+	struct line **pending; /* Added key lines whose section isn't known yet, they weren't linked in when added */
+	size_t npending;
+	size_t pending_cap;
+	size_t headers;
+	int stale;
+	char sep[16]; /* How the first key line separates key and value, for new lines */
+};
+
+/* Text and parse of 'line', in a scratch buffer shared by the conf functions */
+int conf_line(struct line *line, const char **key, size_t *key_len, const char **value, size_t *value_len)
+{
+	static char *buf;
+	static size_t cap;
+	const char *text = line_text(line, &buf, &cap);
+
+	return conf_parse(text, strlen(text), key, key_len, value, value_len);
+}
+
+void conf_insert(struct conf_index *conf, struct line *line, struct line *section, uint64_t hash)
+{
+	struct conf_entry *entry;
+	struct conf_entry **grown;
+
+	if (conf->count >= conf->nbuckets) {
+		grown = (struct conf_entry **) MALLOC(conf->nbuckets * 2 * sizeof(struct conf_entry *));
+		(void) memset(grown, 0, conf->nbuckets * 2 * sizeof(struct conf_entry *));
+		for (size_t i = 0; i < conf->nbuckets; i++) {
+			while (conf->buckets[i] != NULL) {
+				entry = conf->buckets[i];
+				conf->buckets[i] = entry->next;
+				entry->next = grown[entry->hash & (conf->nbuckets * 2 - 1)];
+				grown[entry->hash & (conf->nbuckets * 2 - 1)] = entry;
+			}
+		}
+		FREE(conf->buckets);
+		conf->buckets = grown;
+		conf->nbuckets *= 2;
+	}
+
+	entry = ALLOC_LL(struct conf_entry);
+	entry->hash = hash;
+	entry->line = line;
+	entry->section = section;
+	entry->next = conf->buckets[hash & (conf->nbuckets - 1)];
+	conf->buckets[hash & (conf->nbuckets - 1)] = entry;
+	conf->count++;
+}
+
+void conf_clear(struct conf_index *conf)
+{
+	struct conf_entry *entry;
+
+	for (size_t i = 0; i < conf->nbuckets; i++) {
+		while (conf->buckets[i] != NULL) {
+			entry = conf->buckets[i];
+			conf->buckets[i] = entry->next;
+			FREE(entry);
+		}
+	}
+	conf->count = 0;
+	conf->npending = 0;
+}
+
+void destroy_conf(struct conf_index *conf)
+{
+	if (conf == NULL) {
+		return ;
+	}
+
+	conf_clear(conf);
+	FREE(conf->buckets);
+	FREE(conf->pending);
+	FREE(conf);
+}
+
+/* Keeps the current buffer's conf index up to date as 'line' comes or goes */
+void conf_index_update(struct line *line, int added)
+{
+	struct conf_index *conf = curbuf->conf;
+	struct conf_entry **link;
+	struct conf_entry *entry;
+	const char *key;
+	const char *value;
+	size_t key_len;
+	size_t value_len;
+	int type;
+
+	if (conf == NULL || conf->stale) {
+		return ;
+	}
+
+	type = conf_line(line, &key, &key_len, &value, &value_len);
+	if (type == CONF_SECTION) {
+		conf->headers += added ? 1 : -1;
+		conf->stale = 1;
+		return ;
+	}
+	if (type != CONF_KEY) {
+		return ;
+	}
+
+	if (added) {
+		if (conf->headers == 0) {
+			conf_insert(conf, line, NULL, hash_bytes(key, key_len));
+			return ;
+		}
+
+		if (conf->npending == conf->pending_cap) {
+			struct line **grown;
+
+			conf->pending_cap = conf->pending_cap == 0 ? 16 : conf->pending_cap * 2;
+			grown = (struct line **) MALLOC(conf->pending_cap * sizeof(struct line *));
+			if (conf->npending != 0) {
+				(void) memcpy(grown, conf->pending, conf->npending * sizeof(struct line *));
+			}
+			FREE(conf->pending);
+			conf->pending = grown;
+		}
+		conf->pending[conf->npending++] = line;
+		return ;
+	}
+
+	for (size_t i = 0; i < conf->npending; i++) {
+		if (conf->pending[i] == line) {
+			conf->pending[i] = conf->pending[--conf->npending];
+			return ;
+		}
+	}
+
+	for (link = &conf->buckets[hash_bytes(key, key_len) & (conf->nbuckets - 1)]; *link != NULL; link = &(*link)->next) {
+		if ((*link)->line == line) {
+			entry = *link;
+			*link = entry->next;
+			FREE(entry);
+			conf->count--;
+			return ;
+		}
+	}
+}
+
+/* The two bloom filter bits of the trigram at 's' */
+void zone_trigram_bits(const char *s, uint32_t *a, uint32_t *b)
+{
+	uint64_t h = ((uint64_t) (unsigned char) s[0] | (uint64_t) (unsigned char) s[1] << 8 |
+			(uint64_t) (unsigned char) s[2] << 16) * 0x9E3779B97F4A7C15ULL;
+
+	*a = (uint32_t) (h >> 50);
+	*b = (uint32_t) (h >> 36) & (ZONE_BLOOM_BITS - 1);
+}
+
+/* Drops every zone, lines join new ones as they are read again */
+void zone_reset(struct line *start)
+{
+	for (; start != NULL; start = start->next) {
+		start->zone = NULL;
+	}
+
+	for (size_t i = 0; i < curbuf->zones.count; i++) {
+		FREE(curbuf->zones.zones[i]);
+	}
+	FREE(curbuf->zones.zones);
+	curbuf->zones.zones = NULL;
+	curbuf->zones.count = 0;
+	curbuf->zones.cap = 0;
+}
+
+/* Adds line 'number' (of the index), whose text a search just read, to a zone */
+void zone_absorb(size_t number, const char *text)
+{
+	struct line *line = curbuf->index.lines[number - 1];
+	struct zone *zone = NULL;
+	struct zone *near[2];
+	struct zone **grown;
+	size_t len = strlen(text);
+	uint32_t a;
+	uint32_t b;
+
+	/* Dead and tiny zones pile up after a lot of editing, start over when there are too many */
+	if (curbuf->zones.count > 2 * (curbuf->index.count / ZONE_LINES) + 64) {
+		zone_reset(curbuf->start);
+	}
+
+	near[0] = number > 1 ? curbuf->index.lines[number - 2]->zone : NULL;
+	near[1] = number < curbuf->index.count ? curbuf->index.lines[number]->zone : NULL;
+	for (int i = 0; i < 2 && zone == NULL; i++) {
+		if (near[i] != NULL && near[i]->lines < ZONE_LINES && near[i]->trigrams + len < ZONE_TRIGRAMS) {
+			zone = near[i];
+		}
+	}
+
+	if (zone == NULL) {
+		if (curbuf->zones.count == curbuf->zones.cap) {
+			curbuf->zones.cap = curbuf->zones.cap == 0 ? 64 : curbuf->zones.cap * 2;
+			grown = (struct zone **) MALLOC(curbuf->zones.cap * sizeof(struct zone *));
+			if (curbuf->zones.count != 0) {
+				(void) memcpy(grown, curbuf->zones.zones, curbuf->zones.count * sizeof(struct zone *));
+			}
+			FREE(curbuf->zones.zones);
+			curbuf->zones.zones = grown;
+		}
+
+		zone = ALLOC_LL(struct zone);
+		(void) memset(zone, 0, sizeof(*zone));
+		curbuf->zones.zones[curbuf->zones.count++] = zone;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		zone->bytes[(unsigned char) text[i] >> 6] |= 1ULL << ((unsigned char) text[i] & 63);
+	}
+	for (size_t i = 0; i + 3 <= len; i++) {
+		zone_trigram_bits(text + i, &a, &b);
+		zone->bloom[a >> 6] |= 1ULL << (a & 63);
+		zone->bloom[b >> 6] |= 1ULL << (b & 63);
+	}
+
+	zone->lines++;
+	zone->trigrams += len;
+	zone->checked = 0;
+	line->zone = zone;
+}
+
+/* Whether the zone may hold a line with the cached literal, worked out once per zone and pattern */
+int zone_may_match(struct zone *zone)
+{
+	if (zone->checked == search_cache.serial) {
+		return zone->may_match;
+	}
+
+	zone->checked = search_cache.serial;
+	zone->may_match = 1;
+	for (int i = 0; i < 4; i++) {
+		if ((search_cache.bytes[i] & ~zone->bytes[i]) != 0) {
+			zone->may_match = 0;
+		}
+	}
+	for (size_t i = 0; i < search_cache.nbits && zone->may_match; i++) {
+		zone->may_match = (zone->bloom[search_cache.bits[i] >> 6] >> (search_cache.bits[i] & 63)) & 1;
+	}
+
+	return zone->may_match;
+}
+
+/* Called whenever a line enters the buffer */
+void line_added(struct line *line)
+{
+	curbuf->stats.lines++;
+	curbuf->stats.words += line->words;
+	curbuf->stats.bytes += line->len + 1;
+	curbuf->stats.hist[hist_bucket(line->len)]++;
+	input_cost.touched++;
+	curbuf->edit_count++;
+	key_index_update(line, 1);
+	conf_index_update(line, 1);
+
+	if (line->len > curbuf->stats.longest) {
+		curbuf->stats.longest = line->len;
+		curbuf->stats.longest_count = 1;
+	} else if (line->len == curbuf->stats.longest && curbuf->stats.longest_count != 0) {
+		curbuf->stats.longest_count++;
+	}
+
+	curbuf->index.valid = 0;
+}
+
+/* Called whenever a line leaves the buffer, before it is destroyed */
+void line_removed(struct line *line)
+{
+	curbuf->stats.lines--;
+	curbuf->stats.words -= line->words;
+	curbuf->stats.bytes -= line->len + 1;
+	curbuf->stats.hist[hist_bucket(line->len)]--;
+	input_cost.touched++;
+	curbuf->edit_count++;
+	key_index_update(line, 0);
+	conf_index_update(line, 0);
+	field_cache_detach(line);
+
+	if (line->zone != NULL) {
+		line->zone->lines--;
+		line->zone = NULL;
+	}
+
+	for (int i = 0; i < 26; i++) {
+		if (curbuf->marks[i] == line) {
+			curbuf->marks[i] = NULL;
+		}
+	}
+
+	/* Last line of the longest length is gone, 'wc' will rescan for the new one */
+	if (line->len == curbuf->stats.longest && curbuf->stats.longest_count != 0) {
+		curbuf->stats.longest_count--;
+	}
+
+	curbuf->index.valid = 0;
+}
+
+void destroy_index()
+{
+	FREE(curbuf->index.lines);
+	FREE(curbuf->index.bytes);
+	FREE(curbuf->index.words);
+	curbuf->index.lines = NULL;
+	curbuf->index.bytes = NULL;
+	curbuf->index.words = NULL;
+	curbuf->index.count = 0;
+	curbuf->index.valid = 0;
+}
+
+/* Rebuilds the line index if an edit has invalidated it */
+void build_index(struct line *start)
+{
+	size_t i;
+
+	if (curbuf->index.valid) {
+		return ;
+	}
+
+	destroy_index();
+
+	curbuf->index.count = curbuf->stats.lines;
+	curbuf->index.lines = (struct line **) MALLOC((curbuf->index.count + 1) * sizeof(struct line *));
+	curbuf->index.bytes = (size_t *) MALLOC((curbuf->index.count + 1) * sizeof(size_t));
+	curbuf->index.words = (size_t *) MALLOC((curbuf->index.count + 1) * sizeof(size_t));
+
+	curbuf->index.bytes[0] = 0;
+	curbuf->index.words[0] = 0;
+	for (i = 0; start != NULL; i++, start = start->next) {
+		curbuf->index.lines[i] = start;
+		start->number = i + 1;
+		curbuf->index.bytes[i + 1] = curbuf->index.bytes[i] + start->len + 1;
+		curbuf->index.words[i + 1] = curbuf->index.words[i] + start->words;
+	}
+
+	curbuf->index.valid = 1;
+	curbuf->index.generation = ++index_generations;
+}
+
+/* Convert a line to a char array */
+char *lines_to_charray(struct line *line)
+{
+	struct character *chars;
+	struct character *idx;
+	
+	char *buffer;
+	size_t buffer_size = 0;
+	
+	chars = line->data;
+	idx = chars;
+
+	while (idx != NULL) {
+		buffer_size++;
+		idx = idx->next;
+	}
+
+	buffer = (char *) MALLOC(buffer_size + 2);
+	idx = chars;
+
+	for (size_t i = 0; idx != NULL; i++) {
+		buffer[i] = (char) idx->c;
+		idx = idx->next;
+	}
+
+	buffer[buffer_size] = '\n';
+	buffer[buffer_size + 1] = '\0';
+	return buffer;
+}
+
+FILE *create_empty_file(const char *fname)
+{
+	FILE *create_file;
+
+	create_file = fopen(fname, "w+");
+	if (create_file == NULL) {
+		perror("ed: create_empty_file");
+		exit(EXIT_FAILURE);
+	}
+
+	return create_file;
+}
+
+/* Read lines from file 'fname', store in dest */
+void read_lines(const char *fname, struct line **dest)
+{
+	FILE *file;
+
+	struct line *idx;
+
+	char *current_line;
+	size_t line_size;
+
+	short lines_read;
+
+	file = fopen(fname, "r");
+	if (file == NULL) {
+		/* No such file or directory */
+		if (errno == ENOENT) {
+			file = create_empty_file(fname);
+		} else {
+			perror("ed");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	*dest = ALLOC_LL(struct line);
+	(*dest)->prev = NULL;
+	(*dest)->next = NULL;
+	idx = *dest;
+
+	current_line = NULL;
+	lines_read = 0;
+	while (getline(&current_line, &line_size, file) != -1) {
+		HEAP_ADOPT(current_line, line_size);
+		charray_to_line(idx, current_line);
+		line_added(idx);
+		FREE(current_line);
+		APPEND_LL(idx);
+		idx = idx->next;
+		current_line = NULL;
+
+		if (lines_read == 0) {
+			lines_read = 1;
+		}
+	}
+
+	FREE(current_line);
+
+	/* If no lines were read, empty buffer */
+	if (lines_read == 0) {
+		FREE(*dest);
+		*dest = NULL;
+		(void) fclose(file);
+		return ;
+	}
+
+	/* Allocated one extra line, get rid of it */
+	idx = idx->prev;
+	FREE(idx->next);
+	idx->next = NULL;
+
+	(void) fclose(file);
+
+}
+
+void print_chars(struct character *chars)
+{
+	while (chars != NULL) {
+		(void) putc((int) chars->c, stdout);
+		chars = chars->next;
+	}
+}
+
+void print_line(struct line *line)
+{
+	io_begin();
+	if (line != NULL) {
+		print_chars(line->data);
+		input_cost.touched++;
+	}
+	(void) fputc('\n', stdout);
+	io_end();
+}
+
+void destroy_chars(struct character *chars)
+{
+	struct character *tmp;
+
+	while (chars != NULL) {
+		tmp = chars->next;
+		FREE(chars);
+		chars = tmp;
+	}
+}
+
+void destroy_line(struct line *line)
+{
+	/* Shared text goes with the last line using it */
+	if (line->refs != NULL && --*line->refs > 0) {
+		FREE(line);
+		return ;
+	}
+
+	FREE(line->refs);
+	destroy_chars(line->data);
+	FREE(line);
+}
+
+void destroy_lines(struct line *lines)
+{
+	struct line *tmp;
+
+	while (lines != NULL) {
+		tmp = lines->next;
+		destroy_line(lines);
+		lines = tmp;
+	}
+}
+
+/* Writes lines to handle/stream */
+void lines_to_handle(FILE *file, struct line *lines)
+{
+	char *line;
+
+	io_begin();
+	while (lines != NULL) {
+		line = lines_to_charray(lines);
+
+		(void) fprintf(file, "%s", line);
+
+		FREE(line);
+		lines = lines->next;
+		input_cost.touched++;
+	}
+	io_end();
+}
+
+/* Buffers smaller than this are written by one thread, the threads and the temporary file aren't worth it */
+#define SAVE_PARALLEL_BYTES (16 * 1024 * 1024)
+
+struct save {
+	struct line **lines;
+	size_t *offsets; /* Of each line in the file */
+	char *map;
+};
+
+void save_chunk(void *ctx, size_t begin, size_t end)
+{
+	struct save *save = (struct save *) ctx;
+	struct character *c;
+	char *out;
+
+	for (size_t i = begin; i < end; i++) {
+		out = save->map + save->offsets[i];
+		for (c = save->lines[i]->data; c != NULL; c = c->next) {
+			*out++ = (char) c->c;
+		}
+		*out = '\n';
+	}
+}
+
+/* Writes the current buffer with every worker thread at once: the line index's byte prefix sums say where each
+ * line goes, so each thread copies its lines into a shared mapping of a preallocated temporary file, which is
+ * then renamed over 'fname'. Returns 0 (having changed nothing) if it can't, for write_lines() to fall back on.
+ */
+int write_lines_parallel(const char *fname)
+{
+	char tmp[4096];
+	struct stat st;
+	struct save save;
+	size_t size;
+	int err;
+	int fd;
+
+	/* Renaming would turn a symlink into a file and split a hard link, leave those to the usual way */
+	if (lstat(fname, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink > 1) {
+		return 0;
+	}
+
+	if ((size_t) snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fname) >= sizeof(tmp)) {
+		return 0;
+	}
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		return 0;
+	}
+
+	build_index(curbuf->start);
+	size = curbuf->index.bytes[curbuf->index.count];
+
+	/* Allocating it up front keeps the file in few extents and fails early when the disk is full, where a sparse
+	 * file would have the threads' stores into the mapping die of SIGBUS. Only a file system that can't preallocate
+	 * gets a sparse one.
+	 */
+	err = posix_fallocate(fd, 0, (off_t) size);
+	if (err != 0 && ((err != EOPNOTSUPP && err != EINVAL) || ftruncate(fd, (off_t) size) != 0)) {
+		goto fail;
+	}
+
+	save.map = (char *) mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+	if (save.map == MAP_FAILED) {
+		goto fail;
+	}
+	save.lines = curbuf->index.lines;
+	save.offsets = curbuf->index.bytes;
+	parallel_for(curbuf->index.count, 65536, save_chunk, &save);
+	(void) munmap(save.map, size);
+
+	/* As with checkpoints, the mapping's pages have to be on disk before the rename makes them the file */
+	(void) fchown(fd, st.st_uid, st.st_gid);
+	if (fchmod(fd, st.st_mode & 07777) != 0 || fsync(fd) != 0) {
+		goto fail;
+	}
+
+	if (close(fd) != 0 || rename(tmp, fname) != 0) {
+		(void) unlink(tmp);
+		return 0;
+	}
+
+	input_cost.touched += curbuf->index.count;
+	return 1;
+
+fail:
+	(void) close(fd);
+	(void) unlink(tmp);
+	return 0;
+}
+
+void write_lines(const char *fname, struct line *lines)
+{
+	FILE *file;
+
+	io_begin();
+	if (lines == curbuf->start && curbuf->stats.bytes >= SAVE_PARALLEL_BYTES && write_lines_parallel(fname)) {
+		io_end();
+		return ;
+	}
+
+	file = fopen(fname, "w");
+	if (file == NULL) {
+		perror("ed");
+		exit(EXIT_FAILURE);
+	}
+
+	lines_to_handle(file, lines);
+	(void) fclose(file);
+	io_end();
+}
+
+/* Links 'line' in after 'prev', or at the start of the buffer if 'prev' is NULL */
+void link_line(struct line **start, struct line *prev, struct line *line)
+{
+	line->prev = prev;
+	line->next = prev != NULL ? prev->next : *start;
+
+	if (line->next != NULL) {
+		line->next->prev = line;
+	}
+
+	if (prev != NULL) {
+		prev->next = line;
+	} else {
+		*start = line;
+	}
+}
+
+/* Records an op, returns 1 if the log took ownership of the (deleted) line */
+int undo_push(int type, struct line *line, struct line *prev)
+{
+	struct undo_op *op;
+	struct undo_op *grown;
+
+	if (!curbuf->undo.recording) {
+		return 0;
+	}
+
+	if (curbuf->undo.count == curbuf->undo.cap) {
+		curbuf->undo.cap = curbuf->undo.cap == 0 ? 64 : curbuf->undo.cap * 2;
+		grown = (struct undo_op *) MALLOC(curbuf->undo.cap * sizeof(struct undo_op));
+		if (curbuf->undo.count != 0) {
+			(void) memcpy(grown, curbuf->undo.ops, curbuf->undo.count * sizeof(struct undo_op));
+		}
+		FREE(curbuf->undo.ops);
+		curbuf->undo.ops = grown;
+	}
+
+	op = &curbuf->undo.ops[curbuf->undo.count++];
+	(void) memset(op, 0, sizeof(*op));
+	op->type = (unsigned char) type;
+	op->group = (unsigned char) curbuf->undo.group_pending;
+	op->line = line;
+	op->prev = prev;
+	curbuf->undo.group_pending = 0;
+
+	return type == UNDO_DELETE;
+}
+
+void insert_line(struct line **start, struct line **line)
+{
+	struct line *new_line;
+	char *buffer;
+	size_t buffer_size;
+	double wait_started;
+
+	stop_insertion = 0;
+	while (!stop_insertion) {
+		new_line = ALLOC_LL(struct line);
+
+		buffer = NULL;
+		wait_started = now();
+		if (getline(&buffer, &buffer_size, stdin) < 0) {
+			/* getline() man page says to free() buffer even if error occured */
+			free(buffer);
+			exit(EXIT_FAILURE);
+		}
+		input_cost.wait += now() - wait_started;
+		HEAP_ADOPT(buffer, buffer_size);
+
+		/* Even if (ctrl+c) is hit, we won't know, if we are waiting for input */
+		if (stop_insertion) {
+			FREE(buffer);
+			FREE(new_line); /* No use of destroy_line() b/c there is no character ll inside */
+			break;
+		}
+
+		charray_to_line(new_line, buffer);
+		FREE(buffer);
+		line_added(new_line);
+
+		/* If nothing is in the buffer, this becomes the first line */
+		link_line(start, *line, new_line);
+		undo_push(UNDO_INSERT, new_line, NULL);
+		*line = new_line;
+	}
+}
+
+/* Takes 'line' out of the list without destroying it, returns the line before it (or after, if it was first) */
+struct line *unlink_line(struct line **start, struct line *line)
+{
+	struct line *ret;
+
+	/* If first line, move the start of the buffer to the next line */
+	if (*start == line) {
+		*start = line->next;
+	}
+
+	if (line->next != NULL) {
+		ret = line->next;
+		line->next->prev = line->prev;
+	}
+
+	if (line->prev != NULL) {
+		ret = line->prev;
+		line->prev->next = line->next;
+	}
+
+	/* Last line of the file, buffer will be empty */
+	if (line->next == NULL && line->prev == NULL) {
+		ret = NULL;
+	}
+
+	return ret;
+}
+
+struct line *delete_line(struct line **start, struct line *line)
+{
+	struct line *prev;
+	struct line *ret;
+
+	if (line == NULL) {
+		return NULL;
+	}
+
+	prev = line->prev;
+	ret = unlink_line(start, line);
+	line_removed(line);
+
+	/* The undo log keeps deleted lines around to put them back */
+	if (!undo_push(UNDO_DELETE, line, prev)) {
+		destroy_line(line);
+	}
+
+	return ret;
+}
+
+/* Adds a line holding 'text' after 'prev' (or first, if NULL), recording it for undo */
+struct line *insert_text(struct line **start, struct line *prev, const char *text)
+{
+	struct line *line;
+
+	line = ALLOC_LL(struct line);
+	charray_to_line(line, (char *) text);
+	line_added(line);
+	link_line(start, prev, line);
+	undo_push(UNDO_INSERT, line, NULL);
+	return line;
+}
+
+void destroy_search_cache()
+{
+	if (search_cache.pattern != NULL) {
+		regfree(&search_cache.re);
+	}
+	FREE(search_cache.pattern);
+	FREE(search_cache.state);
+	FREE(search_cache.bits);
+	(void) memset(&search_cache, 0, sizeof(search_cache));
+}
+
+/* Makes 'pattern' the cached one, an empty pattern reuses the last. Returns -1 if it doesn't compile. */
+int search_prepare(const char *pattern)
+{
+	static unsigned long serials;
+	size_t len;
+
+	if (*pattern == '\0') {
+		return search_cache.pattern != NULL ? 0 : -1;
+	}
+
+	if (search_cache.pattern == NULL || strcmp(search_cache.pattern, pattern) != 0) {
+		destroy_search_cache();
+		if (regcomp(&search_cache.re, pattern, REG_NOSUB) != 0) {
+			return -1;
+		}
+		search_cache.pattern = (char *) MALLOC(strlen(pattern) + 1);
+		(void) strcpy(search_cache.pattern, pattern);
+
+		/* What a zone needs to have for a literal to be in it */
+		search_cache.serial = ++serials;
+		search_cache.literal = strpbrk(pattern, "\\.[]*^$") == NULL;
+		if (search_cache.literal) {
+			len = strlen(pattern);
+			for (size_t i = 0; i < len; i++) {
+				search_cache.bytes[(unsigned char) pattern[i] >> 6] |= 1ULL << ((unsigned char) pattern[i] & 63);
+			}
+
+			search_cache.nbits = len >= 3 ? 2 * (len - 2) : 0;
+			search_cache.bits = (uint32_t *) MALLOC((search_cache.nbits + 1) * sizeof(uint32_t));
+			for (size_t i = 0; i + 3 <= len; i++) {
+				zone_trigram_bits(pattern + i, &search_cache.bits[2 * i], &search_cache.bits[2 * i + 1]);
+			}
+		}
+	}
+
+	/* The index was rebuilt since the results were cached, line numbers have moved */
+	if (search_cache.state == NULL || search_cache.generation != curbuf->index.generation) {
+		FREE(search_cache.state);
+		search_cache.count = curbuf->index.count;
+		search_cache.state = (unsigned char *) MALLOC(search_cache.count + 1);
+		(void) memset(search_cache.state, 0, search_cache.count + 1);
+		search_cache.generation = curbuf->index.generation;
+	}
+
+	return 0;
+}
+
+/* Whether line 'number' matches the cached pattern, consulting and filling the cache */
+int search_matches(size_t number)
+{
+	static char *buf;
+	static size_t cap;
+	struct line *line = curbuf->index.lines[number - 1];
+	const char *text;
+
+	if (search_cache.state[number - 1] == 0) {
+		/* The line's zone may rule it out without reading it */
+		if (search_cache.literal && line->zone != NULL && !zone_may_match(line->zone)) {
+			search_cache.state[number - 1] = 1;
+			curbuf->zones.skipped++;
+			return 0;
+		}
+
+		text = line_text(line, &buf, &cap);
+		search_cache.state[number - 1] = regexec(&search_cache.re, text, 0, NULL, 0) == 0 ? 2 : 1;
+		if (line->zone == NULL) {
+			zone_absorb(number, text);
+		}
+	}
+
+	return search_cache.state[number - 1] == 2;
+}
+
+/* Number of the first line after (dir 1) or before (dir -1) line 'cur' matching 'pattern', wrapping around.
+ * 0 if there is none.
+ */
+size_t search_lines(const char *pattern, size_t cur, int dir)
+{
+	size_t n = curbuf->index.count;
+	size_t number = cur;
+
+	if (n == 0 || search_prepare(pattern) < 0) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		if (dir > 0) {
+			number = number >= n ? 1 : number + 1;
+		} else {
+			number = number <= 1 ? n : number - 1;
+		}
+
+		if (search_matches(number)) {
+			return number;
+		}
+	}
+
+	return 0;
+}
+
+/* Copies a pattern delimited by **s (e.g. /re/) into 'pattern', advancing *s past it.
+ * A backslash before the delimiter makes it part of the pattern. Returns -1 if it doesn't fit.
+ */
+int parse_pattern(char **s, char *pattern, size_t size)
+{
+	char *p = *s;
+	char delim;
+	size_t len;
+
+	delim = *p++;
+	for (len = 0; *p != delim && *p != '\0' && *p != '\n'; p++) {
+		if (*p == '\\' && p[1] == delim) {
+			p++;
+		}
+		if (len + 1 >= size) {
+			return -1;
+		}
+		pattern[len++] = *p;
+	}
+	pattern[len] = '\0';
+	if (*p == delim) {
+		p++;
+	}
+
+	*s = p;
+	return 0;
+}
+
+/* Parses an address at *s: a number, '.', '$', 'x (mark), /re/ or ?re?, followed by any +n/-n offsets.
+ * Returns 1 and sets 'addr' if there was one, 0 if not, -1 on error.
+ */
+int parse_address(char **s, size_t cur, size_t *addr)
+{
+	char pattern[1024];
+	unsigned long offset;
+	int have;
+	char delim;
+	char *p;
+
+	have = 1;
+	p = *s;
+	if (isdigit((unsigned char) *p)) {
+		*addr = strtoul(p, &p, 10);
+	} else if (*p == '.') {
+		*addr = cur;
+		p++;
+	} else if (*p == '$') {
+		*addr = curbuf->index.count;
+		p++;
+	} else if (*p == '\'') {
+		if (!islower((unsigned char) p[1]) || curbuf->marks[p[1] - 'a'] == NULL) {
+			return -1;
+		}
+		*addr = curbuf->marks[p[1] - 'a']->number;
+		p += 2;
+	} else if (*p == '/' || *p == '?') {
+		delim = *p;
+		if (parse_pattern(&p, pattern, sizeof(pattern)) < 0) {
+			return -1;
+		}
+
+		*addr = search_lines(pattern, cur, delim == '/' ? 1 : -1);
+		if (*addr == 0) {
+			return -1;
+		}
+	} else {
+		have = 0;
+		*addr = cur;
+	}
+
+	while (*p == '+' || *p == '-') {
+		delim = *p++;
+		offset = 1;
+		if (isdigit((unsigned char) *p)) {
+			offset = strtoul(p, &p, 10);
+		}
+
+		if (delim == '-' && offset > *addr) {
+			return -1;
+		}
+		*addr = delim == '+' ? *addr + offset : *addr - offset;
+		have = 1;
+	}
+
+	*s = p;
+	if (!have) {
+		return 0;
+	}
+
+	return *addr >= 1 && *addr <= curbuf->index.count ? 1 : -1;
+}
+
+/* Parses 'a', 'a,b' or 'a;b' at *s ('a;b' evaluates b relative to a). A lone ',' is 1,$ and a lone ';' is .,$.
+ * Returns 1 and sets the range if there was one, 0 if not, -1 on error.
+ */
+int parse_range(char **s, struct line *start, struct line *current, size_t *first, size_t *last)
+{
+	size_t cur;
+	char sep;
+	int ret;
+
+	build_index(start);
+	cur = current != NULL ? current->number : 0;
+
+	ret = parse_address(s, cur, first);
+	if (ret < 0) {
+		return -1;
+	}
+
+	if (**s != ',' && **s != ';') {
+		*last = *first;
+		return ret;
+	}
+
+	sep = *(*s)++;
+	if (ret == 0) {
+		*first = sep == ',' ? 1 : cur;
+	}
+	if (sep == ';') {
+		cur = *first;
+	}
+
+	ret = parse_address(s, cur, last);
+	if (ret < 0) {
+		return -1;
+	}
+	if (ret == 0) {
+		*last = curbuf->index.count;
+	}
+
+	if (*first == 0 || *first > *last) {
+		return -1;
+	}
+
+	return 1;
+}
+
+#define FUZZY_MAX_ERRORS 16
+
+/* Bit-parallel approximate matching (Wu-Manber bitap), for patterns of up to 64 characters */
+struct fuzzy {
+	uint64_t masks[256]; /* Bit i is set in masks[c] if pattern[i] == c */
+	uint64_t accept; /* Bit of the last pattern character */
+	int errors;
+	struct line **lines;
+	unsigned char *matched;
+};
+
+/* Whether the line contains the pattern with at most 'errors' insertions, deletions or substitutions.
+ * Bit i of r[d] is set if the first i+1 pattern characters match text ending here with at most d errors.
+ */
+int fuzzy_line(struct fuzzy *f, struct line *line)
+{
+	uint64_t r[FUZZY_MAX_ERRORS + 1];
+	uint64_t prev_old;
+	uint64_t prev_new;
+	uint64_t old;
+	uint64_t mask;
+	struct character *c;
+	size_t i;
+
+	for (int d = 0; d <= f->errors; d++) {
+		r[d] = (1ULL << d) - 1;
+	}
+	if (r[f->errors] & f->accept) {
+		return 1;
+	}
+
+	/* The last character is the padding space */
+	for (i = 0, c = line->data; c != NULL && i + 1 < line->len; i++, c = c->next) {
+		mask = f->masks[c->c];
+
+		prev_old = r[0];
+		r[0] = ((r[0] << 1) | 1) & mask;
+		prev_new = r[0];
+		for (int d = 1; d <= f->errors; d++) {
+			old = r[d];
+			/* Match, insertion, substitution, deletion, and any prefix of up to d characters */
+			r[d] = (((old << 1) | 1) & mask) | prev_old | ((prev_old | prev_new) << 1) | ((1ULL << d) - 1);
+			prev_old = old;
+			prev_new = r[d];
+		}
+
+		if (r[f->errors] & f->accept) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void fuzzy_chunk(void *ctx, size_t begin, size_t end)
+{
+	struct fuzzy *f = (struct fuzzy *) ctx;
+
+	for (size_t i = begin; i < end; i++) {
+		f->matched[i] = (unsigned char) fuzzy_line(f, f->lines[i]);
+	}
+}
+
+/* '~/pattern/k': prints the lines in [first, last] containing 'pattern' within edit distance k (default 1),
+ * and moves to the first of them. Large ranges are split across the worker threads.
+ */
+int fuzzy_search(struct line **lines, char **s, size_t first, size_t last)
+{
+	char pattern[65];
+	struct fuzzy f;
+	size_t len;
+	size_t count;
+	int moved;
+
+	(*s)++;
+	if (**s == '\0' || **s == '\n' || parse_pattern(s, pattern, sizeof(pattern)) < 0) {
+		return -5;
+	}
+
+	f.errors = 1;
+	if (isdigit((unsigned char) **s)) {
+		f.errors = (int) strtol(*s, s, 10);
+	}
+
+	len = strlen(pattern);
+	if (len == 0 || f.errors > FUZZY_MAX_ERRORS) {
+		return -5;
+	}
+
+	(void) memset(f.masks, 0, sizeof(f.masks));
+	for (size_t i = 0; i < len; i++) {
+		f.masks[(unsigned char) pattern[i]] |= 1ULL << i;
+	}
+	f.accept = 1ULL << (len - 1);
+
+	if (first > last) {
+		return 0;
+	}
+
+	count = last - first + 1;
+	f.lines = &curbuf->index.lines[first - 1];
+	f.matched = (unsigned char *) MALLOC(count);
+	parallel_for(count, 16384, fuzzy_chunk, &f);
+
+	moved = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (!f.matched[i]) {
+			continue;
+		}
+
+		(void) printf("%zu\t", first + i);
+		print_line(f.lines[i]);
+		if (!moved) {
+			*lines = f.lines[i];
+			moved = 1;
+		}
+	}
+
+	FREE(f.matched);
+	return 0;
+}
+
+/* A named command run on a range, as '[range] name args' */
+struct range_command {
+	char *name;
+	int (*run)(struct line **start, struct line **lines, size_t first, size_t last, char *args);
+};
+
+struct range_command *find_range_command(char *s, char **args);
+
+/* Handles a leading address range, moving to its last line.
+ * 'p' and 'd' right after the range print or delete all of it, '~' searches it.
+ */
+int run_address(struct line **start, struct line **lines, char **s)
+{
+	struct range_command *cmd;
+	struct line **range;
+	size_t first;
+	size_t last;
+	char *args;
+	int ret;
+
+	ret = parse_range(s, *start, *lines, &first, &last);
+	if (ret < 0) {
+		return -5;
+	}
+
+	while (ret != 0 && (**s == ' ' || **s == '\t')) {
+		(*s)++;
+	}
+	cmd = find_range_command(*s, &args);
+	if (ret == 0 && **s != '~' && cmd == NULL) {
+		return 0;
+	}
+
+	/* Without a range, '~' and the range commands work on the whole buffer */
+	if (ret == 0) {
+		build_index(*start);
+		first = 1;
+		last = curbuf->index.count;
+	}
+
+	if (cmd != NULL) {
+		*s = args + strlen(args);
+		return cmd->run(start, lines, first, last, args);
+	}
+
+	switch (**s) {
+		case '~':; {return fuzzy_search(lines, s, first, last);}
+		case 'p':; {
+			for (size_t i = first; i <= last; i++) {
+				print_line(curbuf->index.lines[i - 1]);
+			}
+			*lines = curbuf->index.lines[last - 1];
+			(*s)++;
+			break;
+		}
+		case 'd':; {
+			/* Deleting invalidates the index, keep the range's lines */
+			range = (struct line **) MALLOC((last - first + 1) * sizeof(struct line *));
+			(void) memcpy(range, &curbuf->index.lines[first - 1], (last - first + 1) * sizeof(struct line *));
+			for (size_t i = 0; i <= last - first; i++) {
+				*lines = delete_line(start, range[i]);
+			}
+			FREE(range);
+			(*s)++;
+			break;
+		}
+		default:; {
+			*lines = curbuf->index.lines[last - 1];
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* The sidecar of 'dir/file' is 'dir/.file.undo' */
+void undo_path(const char *fname, char *path, size_t size)
+{
+	const char *base = strrchr(fname, '/');
+
+	base = base != NULL ? base + 1 : fname;
+	(void) snprintf(path, size, "%.*s.%s.undo", (int) (base - fname), fname, base);
+}
+
+/* Opens the sidecar if it describes 'fname' as it is on disk, NULL otherwise */
+FILE *undo_open(const char *fname, struct undo_header *header)
+{
+	char path[4096];
+	struct stat st;
+	FILE *file;
+
+	undo_path(fname, path, sizeof(path));
+	file = fopen(path, "r+");
+	if (file == NULL) {
+		return NULL;
+	}
+
+	if (stat(fname, &st) < 0 || fread(header, sizeof(*header), 1, file) != 1 ||
+			memcmp(header->magic, "BLOBUNDO", 8) != 0 ||
+			header->file_size != (uint64_t) st.st_size ||
+			header->mtime_sec != (int64_t) st.st_mtim.tv_sec ||
+			header->mtime_nsec != (int64_t) st.st_mtim.tv_nsec) {
+		(void) fclose(file);
+		return NULL;
+	}
+
+	return file;
+}
+
+/* Whether the loaded ops can be undone, last to first, from the buffer as it is: each line number has to be in the
+ * buffer (or one past it, for deletes) as it will be when its op is undone
+ */
+int undo_loaded_valid()
+{
+	struct undo_op *op;
+	size_t count = curbuf->stats.lines;
+
+	for (size_t i = curbuf->undo.count; i-- > 0;) {
+		op = &curbuf->undo.ops[i];
+		if (op->type == UNDO_INSERT) {
+			if (op->number < 1 || op->number > count) {
+				return 0;
+			}
+			count--;
+		} else if (op->type == UNDO_DELETE) {
+			if (op->number < 1 || op->number > count + 1) {
+				return 0;
+			}
+			count++;
+		} else if (op->type != UNDO_REVERSE && op->type != UNDO_ROTATE) {
+			return 0;
+		} else if (op->number < 1 || op->number > op->last || op->last > count ||
+				op->shift > op->last - op->number) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Reads the sidecar's records into the (empty) log */
+void undo_load(const char *fname)
+{
+	struct undo_header header;
+	unsigned char type_group[2];
+	uint64_t number;
+	uint64_t len;
+	struct undo_op *op;
+	FILE *file;
+	uint64_t records;
+	long offset;
+
+	file = undo_open(fname, &header);
+	if (file == NULL) {
+		/* Missing or stale, the next write starts a new one */
+		curbuf->undo.loaded = 1;
+		curbuf->undo.checked = 1;
+		curbuf->undo.base = 0;
+		curbuf->undo.truncate_at = 0;
+		return ;
+	}
+
+	/* Records past 'base' were written this session and have been undone since */
+	records = curbuf->undo.checked ? curbuf->undo.base : header.records;
+	curbuf->undo.loaded = 1;
+	curbuf->undo.checked = 1;
+	curbuf->undo.base = 0;
+
+	for (uint64_t i = 0; i < records; i++) {
+		offset = ftell(file);
+		if (fread(type_group, sizeof(type_group), 1, file) != 1 ||
+				fread(&number, sizeof(number), 1, file) != 1 ||
+				fread(&len, sizeof(len), 1, file) != 1) {
+			break;
+		}
+
+		(void) undo_push(type_group[0], NULL, NULL);
+		op = &curbuf->undo.ops[curbuf->undo.count - 1];
+		op->group = type_group[1];
+		op->number = (size_t) number;
+		op->offset = offset;
+
+		op->text = (char *) MALLOC(len + 1);
+		if (len != 0 && fread(op->text, len, 1, file) != 1) {
+			curbuf->undo.count--;
+			FREE(op->text);
+			break;
+		}
+		op->text[len] = '\0';
+
+		if ((op->type == UNDO_REVERSE || op->type == UNDO_ROTATE) && len == 2 * sizeof(uint64_t)) {
+			op->last = (size_t) ((uint64_t *) op->text)[0];
+			op->shift = (size_t) ((uint64_t *) op->text)[1];
+		}
+	}
+
+	(void) fclose(file);
+
+	/* Corrupt or edited by hand, treat it like a stale one */
+	if (!undo_loaded_valid()) {
+		for (size_t i = 0; i < curbuf->undo.count; i++) {
+			FREE(curbuf->undo.ops[i].text);
+		}
+		curbuf->undo.count = 0;
+		curbuf->undo.truncate_at = 0;
+	}
+
+	curbuf->undo.persisted = curbuf->undo.count;
+	curbuf->undo.numbered = curbuf->undo.count;
+}
+
+/* Works out the line numbers of the ops made since the last write (or reverse or rotate).
+ * The deletes are rewound (leaving inserted lines in place), which lays out every line that existed since then
+ * in one order. Replaying the ops forward over a Fenwick tree of which of those lines are present at each
+ * point then gives each op's line number in O(log n).
+ */
+void undo_number(struct line **start)
+{
+	struct undo_op *op;
+	struct line *line;
+	size_t *tree;
+	size_t n;
+	size_t e;
+	size_t number;
+
+	for (size_t i = curbuf->undo.count; i-- > curbuf->undo.numbered;) {
+		op = &curbuf->undo.ops[i];
+		if (op->type == UNDO_DELETE) {
+			link_line(start, op->prev, op->line);
+		}
+	}
+
+	n = 0;
+	for (line = *start; line != NULL; line = line->next) {
+		line->number = ++n;
+	}
+
+	tree = (size_t *) MALLOC((n + 1) * sizeof(size_t));
+	for (e = 1; e <= n; e++) {
+		tree[e] = 1;
+	}
+	for (size_t i = curbuf->undo.numbered; i < curbuf->undo.count; i++) {
+		if (curbuf->undo.ops[i].type == UNDO_INSERT) {
+			tree[curbuf->undo.ops[i].line->number] = 0;
+		}
+	}
+	/* Linear time Fenwick tree construction */
+	for (e = 1; e <= n; e++) {
+		if (e + (e & -e) <= n) {
+			tree[e + (e & -e)] += tree[e];
+		}
+	}
+
+	for (size_t i = curbuf->undo.numbered; i < curbuf->undo.count; i++) {
+		op = &curbuf->undo.ops[i];
+
+		if (op->type == UNDO_INSERT) {
+			for (e = op->line->number; e <= n; e += e & -e) {
+				tree[e]++;
+			}
+		}
+
+		number = 0;
+		for (e = op->line->number; e > 0; e -= e & -e) {
+			number += tree[e];
+		}
+		op->number = number;
+
+		if (op->type == UNDO_DELETE) {
+			for (e = op->line->number; e <= n; e += e & -e) {
+				tree[e]--;
+			}
+		}
+	}
+
+	FREE(tree);
+
+	for (size_t i = curbuf->undo.numbered; i < curbuf->undo.count; i++) {
+		op = &curbuf->undo.ops[i];
+		if (op->type == UNDO_DELETE) {
+			(void) unlink_line(start, op->line);
+		}
+	}
+
+	curbuf->undo.numbered = curbuf->undo.count;
+	curbuf->index.valid = 0;
+}
+
+/* Brings the sidecar up to date after 'fname' has been written */
+void undo_persist(const char *fname, struct line **start)
+{
+	static char *buf;
+	static size_t cap;
+	struct undo_header header;
+	unsigned char type_group[2];
+	char path[4096];
+	uint64_t number;
+	uint64_t len;
+	uint64_t range[2];
+	struct undo_op *op;
+	struct stat st;
+	FILE *file;
+
+	undo_path(fname, path, sizeof(path));
+
+	/* The first write checks the sidecar against the file as it was opened */
+	if (!curbuf->undo.checked) {
+		curbuf->undo.checked = 1;
+		file = undo_open(fname, &header);
+		if (file != NULL) {
+			curbuf->undo.base = (size_t) header.records;
+			(void) fclose(file);
+		} else {
+			curbuf->undo.truncate_at = 0;
+		}
+	}
+
+	if (curbuf->undo.count == 0 && curbuf->undo.base == 0 && curbuf->undo.truncate_at != 0 && access(path, F_OK) != 0) {
+		return ;
+	}
+
+	undo_number(start);
+
+	file = fopen(path, "r+");
+	if (file == NULL) {
+		file = fopen(path, "w+");
+		curbuf->undo.truncate_at = 0;
+	}
+	if (file == NULL) {
+		perror("ed: undo");
+		return ;
+	}
+
+	if (curbuf->undo.truncate_at >= 0) {
+		if (curbuf->undo.truncate_at == 0) {
+			curbuf->undo.base = 0;
+			curbuf->undo.truncate_at = sizeof(header);
+		}
+		(void) ftruncate(fileno(file), curbuf->undo.truncate_at);
+		curbuf->undo.truncate_at = -1;
+	}
+
+	(void) fseek(file, 0, SEEK_END);
+	if (ftell(file) < (long) sizeof(header)) {
+		(void) fseek(file, sizeof(header), SEEK_SET);
+	}
+
+	for (; curbuf->undo.persisted < curbuf->undo.count; curbuf->undo.persisted++) {
+		op = &curbuf->undo.ops[curbuf->undo.persisted];
+		op->offset = ftell(file);
+
+		type_group[0] = op->type;
+		type_group[1] = op->group;
+		number = op->number;
+		len = 0;
+		if (op->type == UNDO_DELETE) {
+			len = strlen(line_text(op->line, &buf, &cap));
+		} else if (op->type == UNDO_REVERSE || op->type == UNDO_ROTATE) {
+			/* The text of a reverse or rotate is where its range ends and how far it rotated */
+			range[0] = op->last;
+			range[1] = op->shift;
+			len = sizeof(range);
+		}
+
+		(void) fwrite(type_group, sizeof(type_group), 1, file);
+		(void) fwrite(&number, sizeof(number), 1, file);
+		(void) fwrite(&len, sizeof(len), 1, file);
+		(void) fwrite(op->type == UNDO_DELETE ? (void *) buf : (void *) range, 1, len, file);
+	}
+
+	(void) memset(&header, 0, sizeof(header));
+	(void) memcpy(header.magic, "BLOBUNDO", 8);
+	if (stat(fname, &st) == 0) {
+		header.file_size = (uint64_t) st.st_size;
+		header.mtime_sec = (int64_t) st.st_mtim.tv_sec;
+		header.mtime_nsec = (int64_t) st.st_mtim.tv_nsec;
+	}
+	header.records = curbuf->undo.base + curbuf->undo.count;
+
+	(void) fseek(file, 0, SEEK_SET);
+	(void) fwrite(&header, sizeof(header), 1, file);
+	(void) fclose(file);
+}
+
+/* After lines first to last were reordered: renumbers them and redoes their part of the prefix sums,
+ * so the index stays valid without walking the rest of the buffer.
+ */
+void reorder_done(size_t first, size_t last)
+{
+	struct line_index *index = &curbuf->index;
+
+	for (size_t i = first - 1; i < last; i++) {
+		index->lines[i]->number = i + 1;
+		index->bytes[i + 1] = index->bytes[i] + index->lines[i]->len + 1;
+		index->words[i + 1] = index->words[i] + index->lines[i]->words;
+	}
+	index->generation = ++index_generations;
+
+	/* Which section a key is in depends on the order of the lines, the conf index has to be rebuilt */
+	if (curbuf->conf != NULL) {
+		curbuf->conf->stale = 1;
+	}
+
+	input_cost.touched++;
+	curbuf->edit_count++;
+}
+
+/* Reverses lines first to last (1-based, the index must be valid) by swapping their links, the text isn't touched */
+struct line *reverse_lines(struct line **start, size_t first, size_t last)
+{
+	struct line *head = curbuf->index.lines[first - 1];
+	struct line *tail = curbuf->index.lines[last - 1];
+	struct line *before = head->prev;
+	struct line *after = tail->next;
+	struct line *line;
+	struct line *next;
+
+	for (line = head; line != after; line = next) {
+		next = line->next;
+		line->next = line->prev;
+		line->prev = next;
+	}
+
+	tail->prev = before;
+	if (before != NULL) {
+		before->next = tail;
+	} else {
+		*start = tail;
+	}
+	head->next = after;
+	if (after != NULL) {
+		after->prev = head;
+	}
+
+	for (size_t i = first - 1, j = last - 1; i < j; i++, j--) {
+		line = curbuf->index.lines[i];
+		curbuf->index.lines[i] = curbuf->index.lines[j];
+		curbuf->index.lines[j] = line;
+	}
+	reorder_done(first, last);
+
+	return tail;
+}
+
+/* Rotates lines first to last so line first + shift comes first. The list is spliced in O(1), the index in O(range). */
+struct line *rotate_lines(struct line **start, size_t first, size_t last, size_t shift)
+{
+	struct line **lines = &curbuf->index.lines[first - 1];
+	struct line *head = lines[0];
+	struct line *tail = lines[last - first];
+	struct line *before = head->prev;
+	struct line *after = tail->next;
+	struct line *pivot = lines[shift];
+	struct line *moved;
+	size_t n = last - first + 1;
+
+	if (shift == 0) {
+		return head;
+	}
+
+	/* head .. pivot->prev, pivot .. tail becomes pivot .. tail, head .. pivot->prev */
+	moved = pivot->prev;
+	pivot->prev = before;
+	if (before != NULL) {
+		before->next = pivot;
+	} else {
+		*start = pivot;
+	}
+	tail->next = head;
+	head->prev = tail;
+	moved->next = after;
+	if (after != NULL) {
+		after->prev = moved;
+	}
+
+	/* Three reversals rotate the index in place */
+	for (size_t k = 0; k < 3; k++) {
+		size_t i = k == 0 ? 0 : k == 1 ? shift : 0;
+		size_t j = k == 0 ? shift - 1 : n - 1;
+
+		for (; i < j; i++, j--) {
+			moved = lines[i];
+			lines[i] = lines[j];
+			lines[j] = moved;
+		}
+	}
+	reorder_done(first, last);
+
+	return pivot;
+}
+
+/* Records a reverse or rotate. Those move lines around, so the ops before it are numbered first. */
+void undo_push_reorder(struct line **start, int type, size_t first, size_t last, size_t shift)
+{
+	struct undo_op *op;
+
+	if (!curbuf->undo.recording) {
+		return ;
+	}
+
+	if (curbuf->undo.numbered < curbuf->undo.count) {
+		undo_number(start);
+		build_index(*start);
+	}
+
+	(void) undo_push(type, NULL, NULL);
+	op = &curbuf->undo.ops[curbuf->undo.count - 1];
+	op->number = first;
+	op->last = last;
+	op->shift = shift;
+	curbuf->undo.numbered = curbuf->undo.count;
+}
+
+/* Undoes one op, returns the line to make current */
+struct line *undo_op(struct line **start, struct undo_op *op)
+{
+	struct line *line;
+
+	if (op->line != NULL && op->type == UNDO_INSERT) {
+		return delete_line(start, op->line);
+	}
+
+	if (op->line != NULL) {
+		link_line(start, op->prev, op->line);
+		line_added(op->line);
+		return op->line;
+	}
+
+	/* A reverse is its own inverse, a rotate is undone by rotating the rest of the way around */
+	if (op->type == UNDO_REVERSE || op->type == UNDO_ROTATE) {
+		build_index(*start);
+		if (op->number == 0 || op->number > op->last || op->last > curbuf->index.count) {
+			return NULL;
+		}
+		if (op->type == UNDO_REVERSE) {
+			return reverse_lines(start, op->number, op->last);
+		}
+		return rotate_lines(start, op->number, op->last, (op->last - op->number + 1 - op->shift) % (op->last - op->number + 1));
+	}
+
+	/* Loaded from the sidecar, only the line number is known */
+	build_index(*start);
+	if (op->type == UNDO_INSERT) {
+		return op->number != 0 && op->number <= curbuf->index.count ? delete_line(start, curbuf->index.lines[op->number - 1]) : NULL;
+	}
+
+	if (op->number == 0 || op->number > curbuf->index.count + 1) {
+		return NULL;
+	}
+
+	line = ALLOC_LL(struct line);
+	charray_to_line(line, op->text);
+	line_added(line);
+	link_line(start, op->number > 1 ? curbuf->index.lines[op->number - 2] : NULL, line);
+	return line;
+}
+
+/* 'u': undoes the last line of input that changed the buffer */
+int undo_last(const char *fname, struct line **start, struct line **lines)
+{
+	struct undo_op *op;
+	int group;
+
+	if (curbuf->undo.count == 0 && !curbuf->undo.loaded && fname != NULL) {
+		undo_load(fname);
+	}
+
+	if (curbuf->undo.count == 0) {
+		return -5;
+	}
+
+	curbuf->undo.recording = 0;
+	do {
+		op = &curbuf->undo.ops[--curbuf->undo.count];
+		*lines = undo_op(start, op);
+		group = op->group;
+
+		if (curbuf->undo.count < curbuf->undo.numbered) {
+			curbuf->undo.numbered = curbuf->undo.count;
+		}
+		if (curbuf->undo.count < curbuf->undo.persisted) {
+			curbuf->undo.persisted = curbuf->undo.count;
+			curbuf->undo.truncate_at = op->offset;
+		}
+		FREE(op->text);
+	} while (!group && curbuf->undo.count > 0);
+	curbuf->undo.recording = 1;
+
+	return 0;
+}
+
+void destroy_undo()
+{
+	for (size_t i = 0; i < curbuf->undo.count; i++) {
+		if (curbuf->undo.ops[i].type == UNDO_DELETE && curbuf->undo.ops[i].line != NULL) {
+			destroy_line(curbuf->undo.ops[i].line);
+		}
+		FREE(curbuf->undo.ops[i].text);
+	}
+
+	FREE(curbuf->undo.ops);
+	curbuf->undo.ops = NULL;
+	curbuf->undo.count = 0;
+}
+
+/* '[range] reverse': reverses the lines of the range (default the whole buffer), like tac(1), in O(range) */
+int cmd_reverse(struct line **start, struct line **lines, size_t first, size_t last, char *args)
+{
+	if (*args != '\0') {
+		return -5;
+	}
+
+	if (first < last) {
+		undo_push_reorder(start, UNDO_REVERSE, first, last, 0);
+		*lines = reverse_lines(start, first, last);
+	}
+
+	return 0;
+}
+
+/* '[range] rotate k': rotates the lines of the range (default the whole buffer) up by k, down if k is negative,
+ * in O(range)
+ */
+int cmd_rotate(struct line **start, struct line **lines, size_t first, size_t last, char *args)
+{
+	long long k;
+	size_t n;
+	char *end;
+
+	k = strtoll(args, &end, 10);
+	if (end == args || *end != '\0') {
+		return -5;
+	}
+
+	if (first > last) {
+		return 0;
+	}
+
+	n = last - first + 1;
+	k %= (long long) n;
+	if (k < 0) {
+		k += (long long) n;
+	}
+
+	if (k != 0) {
+		undo_push_reorder(start, UNDO_ROTATE, first, last, (size_t) k);
+		*lines = rotate_lines(start, first, last, (size_t) k);
+	}
+
+	return 0;
+}
+
+/* Filter plugins, see blob_plugin.h. They stay loaded once used. */
+struct plugin {
+	char *name;
+	void *handle;
+	const struct blob_plugin *abi;
+	struct plugin *next;
+};
+
+struct plugin *plugins;
+
+#define PLUG_BATCH 4096
+#define PLUG_KEEP 0
+#define PLUG_REPLACE 1
+#define PLUG_DELETE 2
+
+struct plug_edit {
+	unsigned char op;
+	char *text; /* Of a replace */
+};
+
+struct plug_run {
+	const struct blob_plugin *plugin;
+	void *state;
+	struct line **lines; /* The range */
+	struct plug_edit *edits; /* One per line of the range */
+	int failed;
+};
+
+/* What a batch's 'struct blob_edits' points its host at */
+struct plug_batch {
+	struct plug_edit *edits;
+	size_t count;
+};
+
+void plug_replace(struct blob_edits *edits, size_t index, const char *text, size_t len)
+{
+	struct plug_batch *batch = (struct plug_batch *) edits->host;
+	struct plug_edit *edit;
+
+	if (index >= batch->count) {
+		return ;
+	}
+
+	edit = &batch->edits[index];
+	FREE(edit->text);
+	edit->text = (char *) MALLOC(len + 1);
+	(void) memcpy(edit->text, text, len);
+	edit->text[len] = '\0';
+	edit->op = PLUG_REPLACE;
+}
+
+void plug_remove(struct blob_edits *edits, size_t index)
+{
+	struct plug_batch *batch = (struct plug_batch *) edits->host;
+
+	if (index >= batch->count) {
+		return ;
+	}
+
+	FREE(batch->edits[index].text);
+	batch->edits[index].text = NULL;
+	batch->edits[index].op = PLUG_DELETE;
+}
+
+/* Lays each batch of lines out in one buffer and hands the plugin views into it */
+void plug_chunk(void *ctx, size_t begin, size_t end)
+{
+	struct plug_run *run = (struct plug_run *) ctx;
+	struct blob_view views[PLUG_BATCH];
+	struct plug_batch batch;
+	struct blob_edits edits;
+	struct character *c;
+	struct line *line;
+	size_t arena_cap;
+	size_t size;
+	size_t off;
+	size_t len;
+	size_t n;
+	char *arena;
+
+	edits.replace = plug_replace;
+	edits.remove = plug_remove;
+	edits.host = &batch;
+
+	arena = NULL;
+	arena_cap = 0;
+	for (size_t b = begin; b < end; b += n) {
+		n = end - b < PLUG_BATCH ? end - b : PLUG_BATCH;
+
+		size = 0;
+		for (size_t i = 0; i < n; i++) {
+			size += run->lines[b + i]->len;
+		}
+		if (arena_cap < size + 1) {
+			FREE(arena);
+			arena_cap = (size + 1) * 2;
+			arena = (char *) MALLOC(arena_cap);
+		}
+
+		off = 0;
+		for (size_t i = 0; i < n; i++) {
+			line = run->lines[b + i];
+			views[i].text = arena + off;
+			for (c = line->data, len = 0; c != NULL && len + 1 < line->len; c = c->next, len++) {
+				arena[off++] = (char) c->c;
+			}
+			views[i].len = len;
+		}
+
+		batch.edits = &run->edits[b];
+		batch.count = n;
+		if (run->plugin->filter(run->state, views, n, &edits) != 0) {
+			__atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	FREE(arena);
+}
+
+/* Loads plugin 'name', from BLOB_PLUGIN_PATH (':' separated, default '.') unless it is a path */
+const struct blob_plugin *plugin_load(const char *name)
+{
+	const struct blob_plugin *(*entry)(void);
+	const struct blob_plugin *abi;
+	struct plugin *plugin;
+	const char *search;
+	const char *error;
+	char path[4096];
+	void *handle;
+	size_t len;
+
+	for (plugin = plugins; plugin != NULL; plugin = plugin->next) {
+		if (strcmp(plugin->name, name) == 0) {
+			return plugin->abi;
+		}
+	}
+
+	handle = NULL;
+	if (strchr(name, '/') != NULL) {
+		handle = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+	} else {
+		search = getenv("BLOB_PLUGIN_PATH");
+		for (search = search != NULL ? search : "."; handle == NULL && *search != '\0'; search += len + (search[len] == ':')) {
+			len = strcspn(search, ":");
+			(void) snprintf(path, sizeof(path), "%.*s/%s.so", (int) len, search, name);
+			if (access(path, R_OK) == 0) {
+				handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+			}
+		}
+	}
+
+	if (handle == NULL) {
+		error = dlerror();
+		(void) fprintf(stderr, "ed: plug: %s\n", error != NULL ? error : "not found");
+		return NULL;
+	}
+
+	*(void **) &entry = dlsym(handle, "blob_plugin");
+	abi = entry != NULL ? entry() : NULL;
+	if (abi == NULL || abi->abi != BLOB_PLUGIN_ABI || abi->filter == NULL) {
+		(void) fprintf(stderr, "ed: plug: %s is not a plugin for this version of Blob\n", name);
+		(void) dlclose(handle);
+		return NULL;
+	}
+
+	plugin = ALLOC_LL(struct plugin);
+	plugin->name = (char *) MALLOC(strlen(name) + 1);
+	(void) strcpy(plugin->name, name);
+	plugin->handle = handle;
+	plugin->abi = abi;
+	plugin->next = plugins;
+	plugins = plugin;
+
+	return abi;
+}
+
+void destroy_plugins()
+{
+	struct plugin *plugin;
+
+	while (plugins != NULL) {
+		plugin = plugins;
+		plugins = plugin->next;
+		(void) dlclose(plugin->handle);
+		FREE(plugin->name);
+		FREE(plugin);
+	}
+}
+
+/* '[range] plug name args': runs the lines of the range (default the whole buffer) through a filter plugin,
+ * in parallel batches, then applies the edits it returned.
+ */
+int cmd_plug(struct line **start, struct line **lines, size_t first, size_t last, char *args)
+{
+	const struct blob_plugin *plugin;
+	struct line **range;
+	struct line *line;
+	struct plug_run run;
+	char *name;
+	size_t n;
+
+	name = args;
+	args += strcspn(args, " \t");
+	if (args == name) {
+		return -5;
+	}
+	if (*args != '\0') {
+		*args++ = '\0';
+		args += strspn(args, " \t");
+	}
+
+	plugin = plugin_load(name);
+	if (plugin == NULL) {
+		return -5;
+	}
+
+	(void) memset(&run, 0, sizeof(run));
+	run.plugin = plugin;
+	if (plugin->init != NULL && plugin->init(args, &run.state) != 0) {
+		return -5;
+	}
+
+	if (first > last) {
+		if (plugin->fini != NULL) {
+			plugin->fini(run.state);
+		}
+		return 0;
+	}
+
+	/* Edits invalidate the index, keep the range's lines */
+	n = last - first + 1;
+	range = (struct line **) MALLOC(n * sizeof(struct line *));
+	(void) memcpy(range, &curbuf->index.lines[first - 1], n * sizeof(struct line *));
+	run.lines = range;
+	run.edits = (struct plug_edit *) MALLOC(n * sizeof(struct plug_edit));
+	(void) memset(run.edits, 0, n * sizeof(struct plug_edit));
+
+	parallel_for(n, PLUG_BATCH, plug_chunk, &run);
+	if (plugin->fini != NULL) {
+		plugin->fini(run.state);
+	}
+
+	/* A plugin that failed anywhere changes nothing */
+	for (size_t i = 0; i < n; i++) {
+		if (run.failed || run.edits[i].op == PLUG_KEEP) {
+			FREE(run.edits[i].text);
+			continue;
+		}
+
+		line = range[i];
+		if (run.edits[i].op == PLUG_REPLACE) {
+			line = insert_text(start, line, run.edits[i].text);
+			FREE(run.edits[i].text);
+		}
+		*lines = delete_line(start, range[i]);
+		if (line != range[i]) {
+			*lines = line;
+		}
+	}
+
+	FREE(range);
+	FREE(run.edits);
+
+	return run.failed ? -5 : 0;
+}
+
+/* Named commands that take a range before their name, 'a,b name args' */
+struct range_command range_commands[] = {
+	{"reverse", cmd_reverse},
+	{"rotate", cmd_rotate},
+	{"plug", cmd_plug},
+	{NULL, NULL},
+};
+
+struct range_command *find_range_command(char *s, char **args)
+{
+	struct range_command *cmd;
+	size_t name_len;
+
+	name_len = strcspn(s, " \t\n");
+	for (cmd = range_commands; cmd->name != NULL; cmd++) {
+		if (strlen(cmd->name) != name_len || strncmp(cmd->name, s, name_len) != 0) {
+			continue;
+		}
+
+		s += name_len;
+		while (*s == ' ' || *s == '\t') {
+			s++;
+		}
+		s[strcspn(s, "\n")] = '\0';
+
+		*args = s;
+		return cmd;
+	}
+
+	return NULL;
+}
+
+/* Finds the longest line again after the previous one was deleted */
+void rescan_longest(struct line *start)
+{
+	curbuf->stats.longest = 0;
+	curbuf->stats.longest_count = 0;
+
+	for (; start != NULL; start = start->next) {
+		if (start->len > curbuf->stats.longest) {
+			curbuf->stats.longest = start->len;
+			curbuf->stats.longest_count = 1;
+		} else if (start->len == curbuf->stats.longest) {
+			curbuf->stats.longest_count++;
+		}
+	}
+}
+
+void print_stats(struct stats *st)
+{
+	size_t most;
+	size_t bar;
+
+	(void) printf("%zu %zu %zu %zu\n", st->lines, st->words, st->bytes, st->longest);
+
+	most = 0;
+	for (size_t i = 0; i < HIST_BUCKETS; i++) {
+		if (st->hist[i] > most) {
+			most = st->hist[i];
+		}
+	}
+
+	for (size_t i = 0; i < HIST_BUCKETS; i++) {
+		if (st->hist[i] == 0) {
+			continue;
+		}
+
+		bar = (st->hist[i] * 40 + most - 1) / most;
+		(void) printf("%6zu-%-6zu %8zu ", i == 0 ? 0 : (size_t) 1 << i, ((size_t) 2 << i) - 1, st->hist[i]);
+		while (bar-- > 0) {
+			(void) putc('#', stdout);
+		}
+		(void) putc('\n', stdout);
+	}
+}
+
+/* 'wc [range]': counts for the whole buffer, or the lines in the address range */
+int cmd_wc(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	struct stats range;
+	struct line *line;
+	size_t first;
+	size_t last;
+
+	(void) fname;
+
+	if (*args == '\0') {
+		if (curbuf->stats.longest_count == 0 && curbuf->stats.lines != 0) {
+			rescan_longest(*start);
+		}
+		print_stats(&curbuf->stats);
+		return 0;
+	}
+
+	if (parse_range(&args, *start, *lines, &first, &last) <= 0 || *args != '\0') {
+		return -5;
+	}
+
+	(void) memset(&range, 0, sizeof(range));
+	range.lines = last - first + 1;
+	range.bytes = curbuf->index.bytes[last] - curbuf->index.bytes[first - 1];
+	range.words = curbuf->index.words[last] - curbuf->index.words[first - 1];
+	for (size_t i = first - 1; i < last; i++) {
+		line = curbuf->index.lines[i];
+		range.hist[hist_bucket(line->len)]++;
+		if (line->len > range.longest) {
+			range.longest = line->len;
+		}
+	}
+
+	print_stats(&range);
+	return 0;
+}
+
+/* Background checkpoints: a forked child (sharing the buffer copy-on-write) writes it to '.<file>.ckpt',
+ * so a crash loses at most one interval of edits. The interval is BLOB_CHECKPOINT_SECS (default 30, 0 is off),
+ * stretched so checkpointing stays under 2% of the time, and cut short after CHECKPOINT_EDITS edits.
+ */
+void checkpoint_path(const char *fname, char *path, size_t size)
+{
+	const char *base = strrchr(fname, '/');
+
+	base = base != NULL ? base + 1 : fname;
+	(void) snprintf(path, size, "%.*s.%s.ckpt", (int) (base - fname), fname, base);
+}
+
+void checkpoint_init(const char *fname)
+{
+	char path[4096];
+	struct stat file_st;
+	struct stat ckpt_st;
+	const char *env;
+
+	env = getenv("BLOB_CHECKPOINT_SECS");
+	if (env != NULL) {
+		curbuf->checkpoint.interval = strtod(env, NULL);
+	}
+
+	curbuf->checkpoint.last = now();
+	curbuf->checkpoint.edits = curbuf->edit_count;
+
+	checkpoint_path(fname, path, sizeof(path));
+	if (stat(path, &ckpt_st) == 0 && (stat(fname, &file_st) != 0 || ckpt_st.st_mtime >= file_st.st_mtime)) {
+		(void) fprintf(stderr, "ed: %s is newer than %s, 'recover' loads it\n", path, fname);
+	}
+}
+
+/* Reaps a finished checkpoint, 'block' waits for it */
+void checkpoint_reap(int block)
+{
+	int status;
+
+	if (curbuf->checkpoint.child == 0 || waitpid(curbuf->checkpoint.child, &status, block ? 0 : WNOHANG) == 0) {
+		return ;
+	}
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		curbuf->checkpoint.cost = now() - curbuf->checkpoint.last;
+	}
+	curbuf->checkpoint.child = 0;
+}
+
+/* Called after every line of input, starts a checkpoint when one is due */
+void checkpoint_maybe(const char *fname, struct line *start)
+{
+	char path[4096];
+	char tmp[4096 + 8];
+	double interval;
+	FILE *file;
+	pid_t pid;
+
+	checkpoint_reap(0);
+	if (curbuf->checkpoint.interval <= 0 || curbuf->checkpoint.child != 0 || curbuf->edit_count == curbuf->checkpoint.edits) {
+		return ;
+	}
+
+	interval = curbuf->checkpoint.interval;
+	if (curbuf->checkpoint.cost * CHECKPOINT_COST_FACTOR > interval) {
+		interval = curbuf->checkpoint.cost * CHECKPOINT_COST_FACTOR;
+	}
+
+	/* A burst of edits brings it forward, but never closer than the checkpoint's own cost allows */
+	if (curbuf->edit_count - curbuf->checkpoint.edits >= CHECKPOINT_EDITS) {
+		interval = curbuf->checkpoint.cost * CHECKPOINT_COST_FACTOR / 10;
+	}
+
+	if (now() - curbuf->checkpoint.last < interval) {
+		return ;
+	}
+
+	checkpoint_path(fname, path, sizeof(path));
+	(void) snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	(void) fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("ed: checkpoint");
+		return ;
+	}
+
+	if (pid == 0) {
+		file = fopen(tmp, "w");
+		if (file == NULL) {
+			_exit(EXIT_FAILURE);
+		}
+		lines_to_handle(file, start);
+		if (fflush(file) != 0 || fsync(fileno(file)) != 0 || fclose(file) != 0 || rename(tmp, path) != 0) {
+			_exit(EXIT_FAILURE);
+		}
+		_exit(EXIT_SUCCESS);
+	}
+
+	curbuf->checkpoint.child = pid;
+	curbuf->checkpoint.last = now();
+	curbuf->checkpoint.edits = curbuf->edit_count;
+}
+
+/* The buffer was written or abandoned, the checkpoint is no longer needed */
+void checkpoint_remove(const char *fname)
+{
+	char path[4096];
+
+	if (curbuf->checkpoint.child != 0) {
+		(void) kill(curbuf->checkpoint.child, SIGTERM);
+		checkpoint_reap(1);
+	}
+
+	checkpoint_path(fname, path, sizeof(path));
+	(void) unlink(path);
+	curbuf->checkpoint.edits = curbuf->edit_count;
+}
+
+/* 'recover': replaces the buffer with the last checkpoint */
+int cmd_recover(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	char path[4096];
+
+	if (*args != '\0' || fname == NULL) {
+		return -5;
+	}
+
+	checkpoint_path(fname, path, sizeof(path));
+	if (access(path, R_OK) != 0) {
+		return -5;
+	}
+
+	/* The lines go without line_removed(), so drop what points at them */
+	destroy_keys(curbuf->keys);
+	curbuf->keys = NULL;
+	if (curbuf->conf != NULL) {
+		curbuf->conf->stale = 1;
+	}
+	zone_reset(NULL);
+	field_cache_reset(&curbuf->fields);
+
+	destroy_lines(*start);
+	(void) memset(&curbuf->stats, 0, sizeof(curbuf->stats));
+	(void) memset(curbuf->marks, 0, sizeof(curbuf->marks));
+	curbuf->index.valid = 0;
+
+	/* The history describes the file, not the checkpoint, start over */
+	destroy_undo();
+	curbuf->undo.loaded = 1;
+	curbuf->undo.checked = 1;
+	curbuf->undo.base = 0;
+	curbuf->undo.persisted = 0;
+	curbuf->undo.numbered = 0;
+	curbuf->undo.truncate_at = 0;
+
+	read_lines(path, start);
+	*lines = *start;
+	return 0;
+}
+
+/* Creates an empty buffer and makes it current */
+struct buffer *buffer_new(const char *name, const char *fname)
+{
+	struct buffer *b;
+	struct buffer **tail;
+
+	b = ALLOC_LL(struct buffer);
+	(void) memset(b, 0, sizeof(*b));
+
+	b->name = (char *) MALLOC(strlen(name) + 1);
+	(void) strcpy(b->name, name);
+	if (fname != NULL) {
+		b->fname = (char *) MALLOC(strlen(fname) + 1);
+		(void) strcpy(b->fname, fname);
+	}
+
+	b->undo.truncate_at = -1;
+	b->undo.recording = 1;
+	b->checkpoint.interval = 30;
+
+	for (tail = &buffers; *tail != NULL; tail = &(*tail)->next);
+	*tail = b;
+
+	curbuf = b;
+	return b;
+}
+
+struct buffer *buffer_find(const char *name)
+{
+	struct buffer *b;
+
+	for (b = buffers; b != NULL && strcmp(b->name, name) != 0; b = b->next);
+	return b;
+}
+
+/* Opens 'fname' in a new buffer named after it, or switches to it if it is already open */
+struct buffer *buffer_open(const char *fname)
+{
+	struct buffer *b;
+
+	for (b = buffers; b != NULL; b = b->next) {
+		if (b->fname != NULL && strcmp(b->fname, fname) == 0) {
+			curbuf = b;
+			return b;
+		}
+	}
+
+	b = buffer_new(fname, fname);
+	read_lines(fname, &b->start);
+	b->lines = b->start;
+	checkpoint_init(fname);
+	return b;
+}
+
+/* Frees a buffer and everything in it, if it was current another one becomes current */
+void buffer_destroy(struct buffer *b)
+{
+	struct buffer *active = curbuf;
+	struct buffer **link;
+
+	curbuf = b;
+	if (b->fname != NULL) {
+		checkpoint_remove(b->fname);
+	}
+	destroy_keys(b->keys);
+	b->keys = NULL;
+	destroy_conf(b->conf);
+	b->conf = NULL;
+	zone_reset(NULL);
+	field_cache_reset(&b->fields);
+	destroy_lines(b->start);
+	destroy_index();
+	destroy_undo();
+
+	for (link = &buffers; *link != b; link = &(*link)->next);
+	*link = b->next;
+
+	FREE(b->name);
+	FREE(b->fname);
+	FREE(b);
+
+	curbuf = active == b ? buffers : active;
+}
+
+/* Adds a line holding 'text' after 'prev' (or first, if NULL) in the current buffer, without recording undo */
+struct line *append_line(struct line **start, struct line *prev, const char *text)
+{
+	struct line *line;
+
+	line = ALLOC_LL(struct line);
+	charray_to_line(line, (char *) text);
+	line_added(line);
+	link_line(start, prev, line);
+	return line;
+}
+
+/* 'buffers': lists the open buffers, the current one marked with '*' */
+int cmd_buffers(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	(void) fname;
+	(void) start;
+	(void) lines;
+
+	if (*args != '\0') {
+		return -5;
+	}
+
+	for (struct buffer *b = buffers; b != NULL; b = b->next) {
+		(void) printf("%c @%-24s %10zu %s\n", b == curbuf ? '*' : ' ', b->name, b->stats.lines,
+				b->fname != NULL ? b->fname : "-");
+	}
+
+	return 0;
+}
+
+/* 'open': opens the file named by an rgrep result line (path:line:text) and goes to that line, 'open FILE' opens FILE */
+int cmd_open(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	static char *buf;
+	static size_t cap;
+	struct buffer *b;
+	size_t number;
+	char *text;
+	char *p;
+
+	(void) fname;
+	(void) start;
+
+	/* 'open FILE' opens a file by name */
+	if (*args != '\0') {
+		if (access(args, R_OK) != 0) {
+			return -5;
+		}
+		(void) buffer_open(args);
+		return 0;
+	}
+
+	if (*lines == NULL) {
+		return -5;
+	}
+
+	/* The path ends at the first ':<digits>:' */
+	text = (char *) line_text(*lines, &buf, &cap);
+	for (p = strchr(text, ':'); p != NULL; p = strchr(p + 1, ':')) {
+		if (isdigit((unsigned char) p[1]) && p[1 + strspn(p + 1, "0123456789")] == ':') {
+			break;
+		}
+	}
+	if (p == NULL) {
+		return -5;
+	}
+
+	*p = '\0';
+	number = strtoul(p + 1, NULL, 10);
+	if (access(text, R_OK) != 0) {
+		return -5;
+	}
+
+	b = buffer_open(text);
+	build_index(b->start);
+	if (number >= 1 && number <= b->index.count) {
+		b->lines = b->index.lines[number - 1];
+	}
+
+	return 0;
+}
+
+/* The directory walk shares a stack of directories between the worker threads */
+struct rgrep_walk {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **dirs;
+	size_t ndirs;
+	size_t dirs_cap;
+	size_t busy; /* Workers listing a directory, which may push more */
+	char **files;
+	size_t nfiles;
+	size_t files_cap;
+};
+
+/* A file's matches, formatted as 'path:line:text' lines */
+struct rgrep_result {
+	char *out;
+	size_t len;
+	size_t cap;
+};
+
+struct rgrep {
+	regex_t re;
+	const char *literal; /* Searched for with memmem() instead of the regex, if the pattern has no special characters */
+	size_t literal_len;
+	char **files;
+	struct rgrep_result *results;
+};
+
+/* Appends to a growable array of strings, '*cap' is in elements */
+void push_string(char ***array, size_t *count, size_t *cap, char *str)
+{
+	char **grown;
+
+	if (*count == *cap) {
+		*cap = *cap == 0 ? 64 : *cap * 2;
+		grown = (char **) MALLOC(*cap * sizeof(char *));
+		if (*count != 0) {
+			(void) memcpy(grown, *array, *count * sizeof(char *));
+		}
+		FREE(*array);
+		*array = grown;
+	}
+
+	(*array)[(*count)++] = str;
+}
+
+char *join_path(const char *dir, const char *name)
+{
+	size_t dir_len = strlen(dir);
+	char *path;
+
+	path = (char *) MALLOC(dir_len + strlen(name) + 2);
+	(void) sprintf(path, "%s%s%s", dir, dir_len != 0 && dir[dir_len - 1] == '/' ? "" : "/", name);
+	return path;
+}
+
+void *rgrep_walker(void *arg)
+{
+	struct rgrep_walk *walk = (struct rgrep_walk *) arg;
+	struct dirent *entry;
+	struct stat st;
+	char *dir;
+	char *path;
+	DIR *handle;
+	int is_dir;
+
+	(void) pthread_mutex_lock(&walk->lock);
+	for (;;) {
+		while (walk->ndirs == 0 && walk->busy != 0) {
+			(void) pthread_cond_wait(&walk->cond, &walk->lock);
+		}
+		if (walk->ndirs == 0) {
+			break;
+		}
+
+		dir = walk->dirs[--walk->ndirs];
+		walk->busy++;
+		(void) pthread_mutex_unlock(&walk->lock);
+
+		handle = opendir(dir);
+		while (handle != NULL && (entry = readdir(handle)) != NULL) {
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+				continue;
+			}
+
+			/* Symbolic links are not followed */
+			path = join_path(dir, entry->d_name);
+			if (entry->d_type == DT_UNKNOWN) {
+				is_dir = lstat(path, &st) == 0 ? S_ISDIR(st.st_mode) : -1;
+				is_dir = is_dir < 0 ? -1 : is_dir ? 1 : S_ISREG(st.st_mode) ? 0 : -1;
+			} else {
+				is_dir = entry->d_type == DT_DIR ? 1 : entry->d_type == DT_REG ? 0 : -1;
+			}
+
+			(void) pthread_mutex_lock(&walk->lock);
+			if (is_dir == 1) {
+				push_string(&walk->dirs, &walk->ndirs, &walk->dirs_cap, path);
+				(void) pthread_cond_signal(&walk->cond);
+			} else if (is_dir == 0) {
+				push_string(&walk->files, &walk->nfiles, &walk->files_cap, path);
+			} else {
+				FREE(path);
+			}
+			(void) pthread_mutex_unlock(&walk->lock);
+		}
+		if (handle != NULL) {
+			(void) closedir(handle);
+		}
+		FREE(dir);
+
+		(void) pthread_mutex_lock(&walk->lock);
+		walk->busy--;
+	}
+
+	(void) pthread_cond_broadcast(&walk->cond);
+	(void) pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
+
+void rgrep_append(struct rgrep_result *result, const char *path, size_t number, const char *text, size_t len)
+{
+	size_t need;
+	char *grown;
+
+	need = strlen(path) + len + 32;
+	if (result->len + need > result->cap) {
+		result->cap = (result->len + need) * 2;
+		grown = (char *) MALLOC(result->cap);
+		if (result->len != 0) {
+			(void) memcpy(grown, result->out, result->len);
+		}
+		FREE(result->out);
+		result->out = grown;
+	}
+
+	result->len += (size_t) sprintf(result->out + result->len, "%s:%zu:", path, number);
+	(void) memcpy(result->out + result->len, text, len);
+	result->len += len;
+	result->out[result->len++] = '\n';
+}
+
+/* Searches one mapped file line by line, skipping files that look binary (a NUL in the first 4 KiB) */
+void rgrep_file(struct rgrep *rg, const char *path, struct rgrep_result *result)
+{
+	const char *data;
+	const char *line;
+	const char *end;
+	const char *nl;
+	const char *hit;
+	regmatch_t bounds;
+	struct stat st;
+	size_t number;
+	size_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return ;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		(void) close(fd);
+		return ;
+	}
+
+	data = (const char *) mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void) close(fd);
+	if (data == MAP_FAILED) {
+		return ;
+	}
+
+	end = data + st.st_size;
+	if (memchr(data, '\0', st.st_size < 4096 ? (size_t) st.st_size : 4096) != NULL) {
+		(void) munmap((void *) data, (size_t) st.st_size);
+		return ;
+	}
+
+	number = 0;
+	for (line = data; line < end; line = nl + 1) {
+		/* A literal is searched for across the whole rest of the file, lines are only split up around a hit */
+		if (rg->literal != NULL) {
+			hit = kernels.find_literal(line, (size_t) (end - line), rg->literal, rg->literal_len);
+			if (hit == NULL) {
+				break;
+			}
+			while ((nl = (const char *) memchr(line, '\n', (size_t) (hit - line))) != NULL) {
+				number++;
+				line = nl + 1;
+			}
+		}
+
+		nl = (const char *) memchr(line, '\n', (size_t) (end - line));
+		if (nl == NULL) {
+			nl = end;
+		}
+		len = (size_t) (nl - line);
+		number++;
+
+		if (rg->literal == NULL) {
+			bounds.rm_so = 0;
+			bounds.rm_eo = (regoff_t) len;
+			if (regexec(&rg->re, line, 1, &bounds, REG_STARTEND) != 0) {
+				continue;
+			}
+		}
+
+		rgrep_append(result, path, number, line, len);
+	}
+
+	(void) munmap((void *) data, (size_t) st.st_size);
+}
+
+void rgrep_chunk(void *ctx, size_t begin, size_t end)
+{
+	struct rgrep *rg = (struct rgrep *) ctx;
+
+	for (size_t i = begin; i < end; i++) {
+		rgrep_file(rg, rg->files[i], &rg->results[i]);
+	}
+}
+
+int path_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* 'rgrep /re/ [dir]': searches every file under dir (default '.') in parallel, into the buffer @rgrep */
+int cmd_rgrep(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	pthread_t threads[MAX_WORKERS];
+	struct rgrep_walk walk;
+	struct buffer *results;
+	struct line *last;
+	struct rgrep rg;
+	char pattern[1024];
+	size_t workers;
+	char *dir;
+	char *p;
+
+	(void) fname;
+	(void) start;
+	(void) lines;
+
+	if (*args == '\0' || parse_pattern(&args, pattern, sizeof(pattern)) < 0 || *pattern == '\0') {
+		return -5;
+	}
+	while (*args == ' ' || *args == '\t') {
+		args++;
+	}
+	dir = *args != '\0' ? args : ".";
+
+	(void) memset(&rg, 0, sizeof(rg));
+	if (strpbrk(pattern, "\\.[]*^$") == NULL) {
+		rg.literal = pattern;
+		rg.literal_len = strlen(pattern);
+	} else if (regcomp(&rg.re, pattern, REG_NOSUB) != 0) {
+		return -5;
+	}
+
+	(void) memset(&walk, 0, sizeof(walk));
+	(void) pthread_mutex_init(&walk.lock, NULL);
+	(void) pthread_cond_init(&walk.cond, NULL);
+	p = (char *) MALLOC(strlen(dir) + 1);
+	(void) strcpy(p, dir);
+	push_string(&walk.dirs, &walk.ndirs, &walk.dirs_cap, p);
+
+	workers = worker_count();
+	for (size_t i = 1; i < workers; i++) {
+		if (pthread_create(&threads[i], NULL, rgrep_walker, &walk) != 0) {
+			workers = i;
+			break;
+		}
+	}
+	(void) rgrep_walker(&walk);
+	for (size_t i = 1; i < workers; i++) {
+		(void) pthread_join(threads[i], NULL);
+	}
+	(void) pthread_mutex_destroy(&walk.lock);
+	(void) pthread_cond_destroy(&walk.cond);
+	FREE(walk.dirs);
+
+	qsort(walk.files, walk.nfiles, sizeof(char *), path_cmp);
+	rg.files = walk.files;
+	rg.results = (struct rgrep_result *) MALLOC((walk.nfiles + 1) * sizeof(struct rgrep_result));
+	(void) memset(rg.results, 0, (walk.nfiles + 1) * sizeof(struct rgrep_result));
+	parallel_for(walk.nfiles, 1, rgrep_chunk, &rg);
+
+	results = buffer_find("rgrep");
+	if (results != NULL) {
+		buffer_destroy(results);
+	}
+	results = buffer_new("rgrep", NULL);
+
+	last = NULL;
+	for (size_t i = 0; i < walk.nfiles; i++) {
+		for (size_t off = 0; off < rg.results[i].len; off += strcspn(rg.results[i].out + off, "\n") + 1) {
+			last = append_line(&results->start, last, rg.results[i].out + off);
+		}
+		FREE(rg.results[i].out);
+		FREE(walk.files[i]);
+	}
+	results->lines = results->start;
+
+	FREE(rg.results);
+	FREE(walk.files);
+	if (rg.literal == NULL) {
+		regfree(&rg.re);
+	}
+
+	return 0;
+}
+
+/* 'index -d<c> -f<n>' or 'index -j<key>': indexes the buffer by field n of c separated lines (default tab),
+ * or by a JSON key. 'index' alone shows the index, 'index off' drops it.
+ */
+int cmd_index(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	struct key_index *keys;
+	struct field_scan scan;
+	char *json_key;
+	char delim;
+	long field;
+	char *end;
+
+	(void) fname;
+	(void) lines;
+
+	if (*args == '\0') {
+		keys = curbuf->keys;
+		if (keys == NULL) {
+			(void) puts("no index");
+		} else if (keys->json_key != NULL) {
+			(void) printf("key %s, %zu lines\n", keys->json_key, keys->count);
+		} else {
+			(void) printf("field %d of '%c', %zu lines\n", keys->field, keys->delim, keys->count);
+		}
+		return 0;
+	}
+
+	if (strcmp(args, "off") == 0) {
+		destroy_keys(curbuf->keys);
+		curbuf->keys = NULL;
+		return 0;
+	}
+
+	delim = '\t';
+	field = 1;
+	json_key = NULL;
+	while (*args != '\0') {
+		if (strncmp(args, "-d", 2) == 0 && args[2] != '\0') {
+			delim = args[2];
+			args += 3;
+		} else if (strncmp(args, "-f", 2) == 0) {
+			field = strtol(args + 2, &end, 10);
+			args = end;
+		} else if (strncmp(args, "-j", 2) == 0 && args[2] != '\0' && args[2] != ' ') {
+			args += 2;
+			FREE(json_key);
+			json_key = (char *) MALLOC(strcspn(args, " ") + 1);
+			(void) memcpy(json_key, args, strcspn(args, " "));
+			json_key[strcspn(args, " ")] = '\0';
+			args += strcspn(args, " ");
+		} else {
+			FREE(json_key);
+			return -5;
+		}
+
+		if (*args != '\0' && *args != ' ') {
+			FREE(json_key);
+			return -5;
+		}
+		while (*args == ' ') {
+			args++;
+		}
+	}
+
+	if (field < 1) {
+		FREE(json_key);
+		return -5;
+	}
+
+	destroy_keys(curbuf->keys);
+	keys = ALLOC_LL(struct key_index);
+	keys->delim = delim;
+	keys->field = (int) field;
+	keys->json_key = json_key;
+	keys->count = 0;
+	for (keys->nbuckets = 16; keys->nbuckets < curbuf->stats.lines; keys->nbuckets *= 2);
+	keys->buckets = (struct key_entry **) MALLOC(keys->nbuckets * sizeof(struct key_entry *));
+	(void) memset(keys->buckets, 0, keys->nbuckets * sizeof(struct key_entry *));
+
+	/* Extracting and hashing the keys is the expensive part, do that in parallel (or not at all, if cached) */
+	build_index(*start);
+	(void) memset(&scan, 0, sizeof(scan));
+	scan.cache = &curbuf->fields;
+	scan.keys = keys;
+	scan.lines = curbuf->index.lines;
+	scan.count = curbuf->index.count;
+	field_scan_run(&scan);
+
+	for (size_t i = 0; i < scan.count; i++) {
+		if (scan.has_key[i]) {
+			key_index_insert(keys, scan.lines[i], scan.hashes[i]);
+		}
+	}
+
+	field_scan_free(&scan);
+	curbuf->keys = keys;
+	return 0;
+}
+
+/* 'key VALUE': goes to (and prints) the first line whose key is VALUE */
+int cmd_key(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	static char *buf;
+	static size_t cap;
+	struct key_index *keys = curbuf->keys;
+	struct key_entry *entry;
+	const char *key;
+	size_t key_len;
+	size_t len;
+	uint64_t hash;
+
+	(void) fname;
+	(void) start;
+
+	if (keys == NULL) {
+		return -5;
+	}
+
+	len = strlen(args);
+	hash = hash_bytes(args, len);
+	for (entry = keys->buckets[hash & (keys->nbuckets - 1)]; entry != NULL; entry = entry->next) {
+		if (entry->hash != hash || !line_key(keys, entry->line, &buf, &cap, &key, &key_len)) {
+			continue;
+		}
+
+		if (key_len == len && memcmp(key, args, len) == 0) {
+			*lines = entry->line;
+			print_line(entry->line);
+			return 0;
+		}
+	}
+
+	return -5;
+}
+
+/* One side of a join: its lines, and the key of each, hashed and copied out into 'arena' */
+struct join_side {
+	struct buffer *buffer;
+	struct line **lines;
+	size_t count;
+	struct key_index keys;
+	struct field_scan scan;
+	uint64_t *hashes; /* The scan's */
+	unsigned char *has_key;
+	size_t *key_off; /* Key i is arena[key_off[i] .. key_off[i + 1]] */
+	char *arena;
+};
+
+void join_copy_chunk(void *ctx, size_t begin, size_t end)
+{
+	struct join_side *side = (struct join_side *) ctx;
+
+	for (size_t i = begin; i < end; i++) {
+		if (side->has_key[i]) {
+			line_copy(side->lines[i], side->scan.offs[i], side->scan.lens[i], side->arena + side->key_off[i]);
+		}
+	}
+}
+
+void join_side_load(struct join_side *side)
+{
+	struct buffer *active = curbuf;
+
+	curbuf = side->buffer;
+	build_index(side->buffer->start);
+	curbuf = active;
+
+	side->lines = side->buffer->index.lines;
+	side->count = side->buffer->index.count;
+
+	side->scan.cache = &side->buffer->fields;
+	side->scan.keys = &side->keys;
+	side->scan.lines = side->lines;
+	side->scan.count = side->count;
+	field_scan_run(&side->scan);
+	side->hashes = side->scan.hashes;
+	side->has_key = side->scan.has_key;
+
+	side->key_off = (size_t *) MALLOC((side->count + 1) * sizeof(size_t));
+	side->key_off[0] = 0;
+	for (size_t i = 0; i < side->count; i++) {
+		side->key_off[i + 1] = side->key_off[i] + side->scan.lens[i];
+	}
+
+	side->arena = (char *) MALLOC(side->key_off[side->count] + 1);
+	parallel_for(side->count, 65536, join_copy_chunk, side);
+}
+
+void join_side_free(struct join_side *side)
+{
+	field_scan_free(&side->scan);
+	FREE(side->key_off);
+	FREE(side->arena);
+}
+
+/* A hash table over the smaller ('build') side, probed by the rows of the other side */
+struct join {
+	struct join_side *build;
+	struct join_side *probe;
+	size_t *heads; /* Bucket -> first build row + 1, 0 if empty */
+	size_t *next; /* Build row -> next build row + 1 in the same bucket */
+	size_t mask;
+	size_t *counts; /* Probe row -> matches, then prefix sums of them */
+	size_t *pairs; /* Build rows matching each probe row, in build order */
+	int fill;
+};
+
+void join_probe_chunk(void *ctx, size_t begin, size_t end)
+{
+	struct join *j = (struct join *) ctx;
+	struct join_side *b = j->build;
+	struct join_side *p = j->probe;
+	size_t len;
+	size_t n;
+
+	for (size_t i = begin; i < end; i++) {
+		if (!p->has_key[i]) {
+			if (!j->fill) {
+				j->counts[i] = 0;
+			}
+			continue;
+		}
+
+		len = p->key_off[i + 1] - p->key_off[i];
+		n = 0;
+		for (size_t r = j->heads[p->hashes[i] & j->mask]; r != 0; r = j->next[r - 1]) {
+			if (b->hashes[r - 1] != p->hashes[i] || b->key_off[r] - b->key_off[r - 1] != len ||
+					memcmp(b->arena + b->key_off[r - 1], p->arena + p->key_off[i], len) != 0) {
+				continue;
+			}
+
+			if (j->fill) {
+				j->pairs[j->counts[i] + n] = r - 1;
+			}
+			n++;
+		}
+
+		if (!j->fill) {
+			j->counts[i] = n;
+		}
+	}
+}
+
+/* 'join [-l|-v] [-d<c>] @a @b -f<n> -f<m> [> @out]': joins the lines of a and b whose field n and m (default 1)
+ * are equal, into buffer out (default "join"). Each result is the line from a, then b's line without its key.
+ * -l keeps lines of a without a match as they are (left join), -v keeps only those (anti join).
+ */
+int cmd_join(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	struct join_side side[2];
+	struct buffer *out;
+	struct join j;
+	struct line *last;
+	char *names[3];
+	char *text_buf;
+	char *other_buf;
+	char *joined;
+	size_t text_cap;
+	size_t other_cap;
+	size_t joined_cap;
+	size_t *by_a; /* For each a row, its matching b rows: offsets into 'matched' */
+	size_t *matched;
+	size_t nnames;
+	long fields[2];
+	size_t nfields;
+	char delim;
+	int mode;
+	char *tok;
+	char *end;
+
+	(void) fname;
+	(void) start;
+	(void) lines;
+
+	mode = 0;
+	delim = '\t';
+	nnames = 0;
+	nfields = 0;
+	fields[0] = fields[1] = 1;
+	names[2] = "join";
+	for (tok = strtok(args, " \t"); tok != NULL; tok = strtok(NULL, " \t")) {
+		if (strcmp(tok, "-l") == 0 || strcmp(tok, "-v") == 0) {
+			mode = tok[1];
+		} else if (strncmp(tok, "-d", 2) == 0 && tok[2] != '\0' && tok[3] == '\0') {
+			delim = tok[2];
+		} else if (strncmp(tok, "-f", 2) == 0 && nfields < 2) {
+			fields[nfields++] = strtol(tok + 2, &end, 10);
+			if (*end != '\0' || fields[nfields - 1] < 1) {
+				return -5;
+			}
+		} else if (strcmp(tok, ">") == 0) {
+			tok = strtok(NULL, " \t");
+			if (tok == NULL || *tok != '@' || tok[1] == '\0') {
+				return -5;
+			}
+			names[2] = tok + 1;
+		} else if (*tok == '@' && nnames < 2) {
+			names[nnames++] = tok + 1;
+		} else {
+			return -5;
+		}
+	}
+
+	/* A single field applies to both sides */
+	if (nfields == 1) {
+		fields[1] = fields[0];
+	}
+
+	if (nnames != 2 || strcmp(names[2], names[0]) == 0 || strcmp(names[2], names[1]) == 0) {
+		return -5;
+	}
+
+	(void) memset(side, 0, sizeof(side));
+	for (int s = 0; s < 2; s++) {
+		side[s].buffer = buffer_find(names[s]);
+		if (side[s].buffer == NULL) {
+			return -5;
+		}
+		side[s].keys.delim = delim;
+		side[s].keys.field = (int) fields[s];
+	}
+
+	join_side_load(&side[0]);
+	join_side_load(&side[1]);
+
+	/* Build on the smaller side, probe with the larger one in parallel */
+	(void) memset(&j, 0, sizeof(j));
+	j.build = side[0].count <= side[1].count ? &side[0] : &side[1];
+	j.probe = j.build == &side[0] ? &side[1] : &side[0];
+
+	for (j.mask = 15; j.mask < j.build->count; j.mask = j.mask * 2 + 1);
+	j.heads = (size_t *) MALLOC((j.mask + 1) * sizeof(size_t));
+	(void) memset(j.heads, 0, (j.mask + 1) * sizeof(size_t));
+	j.next = (size_t *) MALLOC((j.build->count + 1) * sizeof(size_t));
+
+	/* Inserting backwards leaves every chain in build order */
+	for (size_t i = j.build->count; i-- > 0;) {
+		if (j.build->has_key[i]) {
+			j.next[i] = j.heads[j.build->hashes[i] & j.mask];
+			j.heads[j.build->hashes[i] & j.mask] = i + 1;
+		}
+	}
+
+	/* Count the matches of each probe row, then fill them in at their prefix sum offsets */
+	j.counts = (size_t *) MALLOC((j.probe->count + 1) * sizeof(size_t));
+	parallel_for(j.probe->count, 65536, join_probe_chunk, &j);
+	for (size_t i = 0, sum = 0, n; i <= j.probe->count; i++) {
+		n = i < j.probe->count ? j.counts[i] : 0;
+		j.counts[i] = sum;
+		sum += n;
+	}
+	j.pairs = (size_t *) MALLOC((j.counts[j.probe->count] + 1) * sizeof(size_t));
+	j.fill = 1;
+	parallel_for(j.probe->count, 65536, join_probe_chunk, &j);
+
+	/* Results come out in the order of a, so if b was probed, group its matches by row of a */
+	if (j.probe == &side[0]) {
+		by_a = j.counts;
+		matched = j.pairs;
+	} else {
+		by_a = (size_t *) MALLOC((side[0].count + 1) * sizeof(size_t));
+		matched = (size_t *) MALLOC((j.counts[side[1].count] + 1) * sizeof(size_t));
+		(void) memset(by_a, 0, (side[0].count + 1) * sizeof(size_t));
+
+		for (size_t k = 0; k < j.counts[side[1].count]; k++) {
+			by_a[j.pairs[k] + 1]++;
+		}
+		for (size_t i = 0; i < side[0].count; i++) {
+			by_a[i + 1] += by_a[i];
+		}
+		for (size_t b = 0; b < side[1].count; b++) {
+			for (size_t k = j.counts[b]; k < j.counts[b + 1]; k++) {
+				matched[by_a[j.pairs[k]]++] = b;
+			}
+		}
+		/* Filling moved each offset to the start of the next row, shift them back */
+		for (size_t i = side[0].count; i > 0; i--) {
+			by_a[i] = by_a[i - 1];
+		}
+		by_a[0] = 0;
+	}
+
+	out = buffer_find(names[2]);
+	if (out != NULL) {
+		buffer_destroy(out);
+	}
+	out = buffer_new(names[2], NULL);
+
+	text_buf = other_buf = joined = NULL;
+	text_cap = other_cap = joined_cap = 0;
+	last = NULL;
+	for (size_t a = 0; a < side[0].count; a++) {
+		const char *text = line_text(side[0].lines[a], &text_buf, &text_cap);
+
+		if (by_a[a] == by_a[a + 1]) {
+			if (mode == 'l' || mode == 'v') {
+				last = append_line(&out->start, last, text);
+			}
+			continue;
+		}
+
+		if (mode == 'v') {
+			continue;
+		}
+
+		for (size_t k = by_a[a]; k < by_a[a + 1]; k++) {
+			struct join_side *b = &side[1];
+			const char *other = line_text(b->lines[matched[k]], &other_buf, &other_cap);
+			size_t text_len = strlen(text);
+			size_t other_len = strlen(other);
+			const char *key = other + b->scan.offs[matched[k]];
+			size_t key_len = b->scan.lens[matched[k]];
+			size_t n;
+
+			if (joined_cap < text_len + other_len + 2) {
+				FREE(joined);
+				joined_cap = (text_len + other_len + 2) * 2;
+				joined = (char *) MALLOC(joined_cap);
+			}
+
+			/* a's line, then what's left of b's after taking out the key and one of the delimiters around it */
+			(void) memcpy(joined, text, text_len);
+			n = text_len;
+			if (key > other) {
+				joined[n++] = delim;
+				(void) memcpy(joined + n, other, (size_t) (key - other) - 1);
+				n += (size_t) (key - other) - 1;
+			}
+			if (key + key_len < other + other_len) {
+				(void) memcpy(joined + n, key + key_len, (size_t) (other + other_len - key - key_len));
+				n += (size_t) (other + other_len - key - key_len);
+			}
+			joined[n] = '\0';
+
+			last = append_line(&out->start, last, joined);
+		}
+	}
+	out->lines = out->start;
+
+	if (by_a != j.counts) {
+		FREE(by_a);
+		FREE(matched);
+	}
+	FREE(j.heads);
+	FREE(j.next);
+	FREE(j.counts);
+	FREE(j.pairs);
+	FREE(text_buf);
+	FREE(other_buf);
+	FREE(joined);
+	join_side_free(&side[0]);
+	join_side_free(&side[1]);
+
+	return 0;
+}
+
+/* A new line sharing the text of 'line', which is never copied: lines are not edited in place */
+struct line *share_line(struct line *line)
+{
+	struct line *shared;
+
+	if (line->refs == NULL) {
+		line->refs = (unsigned *) MALLOC(sizeof(unsigned));
+		*line->refs = 1;
+	}
+
+	shared = ALLOC_LL(struct line);
+	*shared = *line;
+	shared->next = NULL;
+	shared->prev = NULL;
+	shared->zone = NULL;
+	shared->fields = NULL;
+	(*shared->refs)++;
+	return shared;
+}
+
+/* Chained hash table over the lines of a buffer, by their text */
+struct line_set {
+	struct line **lines;
+	size_t count;
+	size_t *heads; /* Bucket -> first line + 1, 0 if empty */
+	size_t *next; /* Line -> next line + 1 in the same bucket, chains are in buffer order */
+	size_t mask;
+};
+
+void line_set_build(struct line_set *set, struct buffer *b)
+{
+	struct buffer *active = curbuf;
+
+	curbuf = b;
+	build_index(b->start);
+	curbuf = active;
+
+	set->lines = b->index.lines;
+	set->count = b->index.count;
+	for (set->mask = 15; set->mask < set->count; set->mask = set->mask * 2 + 1);
+	set->heads = (size_t *) MALLOC((set->mask + 1) * sizeof(size_t));
+	(void) memset(set->heads, 0, (set->mask + 1) * sizeof(size_t));
+	set->next = (size_t *) MALLOC((set->count + 1) * sizeof(size_t));
+
+	for (size_t i = set->count; i-- > 0;) {
+		set->next[i] = set->heads[set->lines[i]->hash & set->mask];
+		set->heads[set->lines[i]->hash & set->mask] = i + 1;
+	}
+}
+
+/* Whether the set has a line equal to 'line' among its first 'before' lines */
+int line_set_has(struct line_set *set, struct line *line, size_t before)
+{
+	for (size_t r = set->heads[line->hash & set->mask]; r != 0 && r <= before; r = set->next[r - 1]) {
+		if (lines_equal(set->lines[r - 1], line)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+struct set_op {
+	struct line_set *self;
+	struct line_set *other;
+	unsigned char *keep;
+	int in_other; /* Keep lines that are (1) or aren't (0) in 'other', or either (-1) */
+};
+
+/* Keeps the first of each run of equal lines, depending on whether it is in the other operand */
+void set_op_chunk(void *ctx, size_t begin, size_t end)
+{
+	struct set_op *op = (struct set_op *) ctx;
+	struct line *line;
+
+	for (size_t i = begin; i < end; i++) {
+		line = op->self->lines[i];
+		op->keep[i] = !line_set_has(op->self, line, i) &&
+			(op->in_other < 0 || line_set_has(op->other, line, op->other->count) == op->in_other);
+	}
+}
+
+/* '@a & @b', '@a | @b' and '@a - @b' [> @out]: the lines in both, either or only a, each once, into buffer
+ * out (default "set"). The lines of a come first and in order. Results share the text of their operands.
+ */
+int set_operation(char *s)
+{
+	struct line_set sets[2];
+	struct buffer *operands[2];
+	struct buffer *out;
+	struct set_op op;
+	struct line *last;
+	struct line *line;
+	char *names[3];
+	char *tok;
+	char oper;
+
+	names[0] = strtok(s, " \t");
+	tok = strtok(NULL, " \t");
+	names[1] = strtok(NULL, " \t");
+	names[2] = "@set";
+	if (tok == NULL || strlen(tok) != 1 || strchr("&|-", *tok) == NULL || names[1] == NULL || *names[1] != '@') {
+		return -5;
+	}
+	oper = *tok;
+
+	tok = strtok(NULL, " \t");
+	if (tok != NULL) {
+		if (strcmp(tok, ">") != 0) {
+			return -5;
+		}
+		names[2] = strtok(NULL, " \t");
+		if (names[2] == NULL || *names[2] != '@' || names[2][1] == '\0' || strtok(NULL, " \t") != NULL) {
+			return -5;
+		}
+	}
+
+	for (int i = 0; i < 2; i++) {
+		operands[i] = buffer_find(names[i] + 1);
+		if (operands[i] == NULL || strcmp(names[i], names[2]) == 0) {
+			return -5;
+		}
+	}
+
+	line_set_build(&sets[0], operands[0]);
+	line_set_build(&sets[1], operands[1]);
+
+	out = buffer_find(names[2] + 1);
+	if (out != NULL) {
+		buffer_destroy(out);
+	}
+	out = buffer_new(names[2] + 1, NULL);
+
+	last = NULL;
+	for (int i = 0; i < 2; i++) {
+		/* A union also takes the lines of b that aren't in a */
+		if (i == 1 && oper != '|') {
+			break;
+		}
+
+		op.self = &sets[i];
+		op.other = &sets[1 - i];
+		op.in_other = i == 0 && oper == '|' ? -1 : i == 0 && oper == '&';
+		op.keep = (unsigned char *) MALLOC(sets[i].count + 1);
+		parallel_for(sets[i].count, 16384, set_op_chunk, &op);
+
+		for (size_t n = 0; n < sets[i].count; n++) {
+			if (!op.keep[n]) {
+				continue;
+			}
+
+			line = share_line(sets[i].lines[n]);
+			line_added(line);
+			link_line(&out->start, last, line);
+			last = line;
+		}
+
+		FREE(op.keep);
+	}
+	out->lines = out->start;
+
+	for (int i = 0; i < 2; i++) {
+		FREE(sets[i].heads);
+		FREE(sets[i].next);
+	}
+
+	return 0;
+}
+
+/* The current buffer's conf index, built or brought up to date */
+struct conf_index *conf_ready(struct line *start)
+{
+	struct conf_index *conf = curbuf->conf;
+	struct line *section;
+	struct line *line;
+	const char *key;
+	const char *value;
+	size_t key_len;
+	size_t value_len;
+	uint64_t hash;
+	int type;
+
+	if (conf == NULL) {
+		conf = ALLOC_LL(struct conf_index);
+		(void) memset(conf, 0, sizeof(*conf));
+		conf->nbuckets = 64;
+		conf->buckets = (struct conf_entry **) MALLOC(conf->nbuckets * sizeof(struct conf_entry *));
+		(void) memset(conf->buckets, 0, conf->nbuckets * sizeof(struct conf_entry *));
+		conf->stale = 1;
+		curbuf->conf = conf;
+	}
+
+	if (conf->stale) {
+		conf_clear(conf);
+		conf->headers = 0;
+		section = NULL;
+		for (line = start; line != NULL; line = line->next) {
+			type = conf_line(line, &key, &key_len, &value, &value_len);
+			if (type == CONF_SECTION) {
+				section = line;
+				conf->headers++;
+			} else if (type == CONF_KEY) {
+				if (conf->sep[0] == '\0' && (size_t) (value - key - key_len) < sizeof(conf->sep)) {
+					(void) memcpy(conf->sep, key + key_len, (size_t) (value - key - key_len));
+					conf->sep[value - key - key_len] = '\0';
+				}
+				conf_insert(conf, line, section, hash_bytes(key, key_len));
+			}
+		}
+		conf->stale = 0;
+	}
+
+	/* Lines added since are linked in by now, so their section is the first header before them */
+	for (size_t i = 0; i < conf->npending; i++) {
+		(void) conf_line(conf->pending[i], &key, &key_len, &value, &value_len);
+		hash = hash_bytes(key, key_len);
+
+		for (section = conf->pending[i]->prev; section != NULL; section = section->prev) {
+			if (conf_line(section, &key, &key_len, &value, &value_len) == CONF_SECTION) {
+				break;
+			}
+		}
+		conf_insert(conf, conf->pending[i], section, hash);
+	}
+	conf->npending = 0;
+
+	if (conf->sep[0] == '\0') {
+		(void) strcpy(conf->sep, "=");
+	}
+
+	return conf;
+}
+
+/* Splits 'section.key' (only if the buffer has sections, properties keys have dots of their own).
+ * 'section' is NULL for keys before the first section, named like '.key' or just 'key'.
+ */
+void conf_name(struct conf_index *conf, const char *name, const char **section, size_t *section_len, const char **key)
+{
+	const char *dot = strchr(name, '.');
+
+	*section = NULL;
+	*section_len = 0;
+	*key = name;
+	if (conf->headers != 0 && dot != NULL) {
+		*section = dot != name ? name : NULL;
+		*section_len = (size_t) (dot - name);
+		*key = dot + 1;
+	}
+}
+
+/* Whether 'line' is the header of section (or, if NULL, is NULL itself) */
+int conf_in_section(struct line *header, const char *section, size_t section_len)
+{
+	const char *name;
+	const char *value;
+	size_t name_len;
+	size_t value_len;
+
+	if (header == NULL || section == NULL) {
+		return header == NULL && section == NULL;
+	}
+
+	return conf_line(header, &name, &name_len, &value, &value_len) == CONF_SECTION &&
+		name_len == section_len && memcmp(name, section, section_len) == 0;
+}
+
+/* The line holding 'name', NULL if there is none */
+struct line *conf_find(struct conf_index *conf, const char *name)
+{
+	struct conf_entry *entry;
+	const char *section;
+	const char *key;
+	const char *found;
+	const char *value;
+	size_t section_len;
+	size_t found_len;
+	size_t value_len;
+	size_t key_len;
+	uint64_t hash;
+
+	conf_name(conf, name, &section, &section_len, &key);
+	key_len = strlen(key);
+	hash = hash_bytes(key, key_len);
+
+	for (entry = conf->buckets[hash & (conf->nbuckets - 1)]; entry != NULL; entry = entry->next) {
+		if (entry->hash != hash || conf_line(entry->line, &found, &found_len, &value, &value_len) != CONF_KEY ||
+				found_len != key_len || memcmp(found, key, key_len) != 0) {
+			continue;
+		}
+
+		if (conf_in_section(entry->section, section, section_len)) {
+			return entry->line;
+		}
+	}
+
+	return NULL;
+}
+
+/* 'get [section.]key': prints the value of key */
+int cmd_get(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	struct line *line;
+	const char *key;
+	const char *value;
+	size_t key_len;
+	size_t value_len;
+
+	(void) fname;
+
+	if (*args == '\0' || strpbrk(args, " \t") != NULL) {
+		return -5;
+	}
+
+	line = conf_find(conf_ready(*start), args);
+	if (line == NULL) {
+		return -5;
+	}
+
+	(void) conf_line(line, &key, &key_len, &value, &value_len);
+	if (value_len >= 2 && (*value == '"' || *value == '\'') && value[value_len - 1] == *value) {
+		value++;
+		value_len -= 2;
+	}
+	(void) printf("%.*s\n", (int) value_len, value);
+
+	*lines = line;
+	return 0;
+}
+
+/* Where a new key of 'section' goes: after the last non-blank line of the section.
+ * Returns 0 if there is no such section.
+ */
+int conf_insert_point(struct line *start, const char *section, size_t section_len, struct line **prev)
+{
+	struct line *line;
+	const char *key;
+	const char *value;
+	size_t key_len;
+	size_t value_len;
+	int type;
+
+	line = start;
+	*prev = NULL;
+	if (section != NULL) {
+		for (; line != NULL && !conf_in_section(line, section, section_len); line = line->next);
+		if (line == NULL) {
+			return 0;
+		}
+		*prev = line;
+		line = line->next;
+	}
+
+	for (; line != NULL; line = line->next) {
+		type = conf_line(line, &key, &key_len, &value, &value_len);
+		if (type == CONF_SECTION) {
+			break;
+		}
+		if (type != 0 || line->words != 0) {
+			*prev = line;
+		}
+	}
+
+	return 1;
+}
+
+/* 'set [section.]key value': changes the value of key in place, keeping the rest of its line as it was.
+ * A new key goes at the end of its section, a new section at the end of the buffer.
+ */
+int cmd_set(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	struct conf_index *conf;
+	struct line *line;
+	struct line *prev;
+	const char *section;
+	const char *key;
+	const char *value;
+	size_t section_len;
+	size_t key_len;
+	size_t value_len;
+	char *name;
+	char *text;
+	char *old;
+	char *buf;
+	size_t cap;
+	char quote;
+
+	(void) fname;
+
+	name = args;
+	args += strcspn(args, " \t");
+	if (args == name) {
+		return -5;
+	}
+	if (*args != '\0') {
+		*args++ = '\0';
+		args += strspn(args, " \t");
+	}
+
+	conf = conf_ready(*start);
+	line = conf_find(conf, name);
+
+	if (line != NULL) {
+		/* A copy of its own, the conf functions share a scratch buffer */
+		buf = NULL;
+		cap = 0;
+		old = (char *) line_text(line, &buf, &cap);
+		(void) conf_parse(old, strlen(old), &key, &key_len, &value, &value_len);
+
+		/* Keep the value's quotes, if it had them */
+		quote = '\0';
+		if (value_len >= 2 && (*value == '"' || *value == '\'') && value[value_len - 1] == *value) {
+			quote = *value;
+		}
+
+		text = (char *) MALLOC(strlen(old) + strlen(args) + 3);
+		(void) sprintf(text, "%.*s%.*s%s%.*s%s", (int) (value - old), old, quote != '\0', &quote, args,
+				quote != '\0', &quote, value + value_len);
+
+		/* New line first, so undo puts the old one back where it was */
+		*lines = insert_text(start, line, text);
+		(void) delete_line(start, line);
+		FREE(text);
+		FREE(buf);
+		return 0;
+	}
+
+	conf_name(conf, name, &section, &section_len, &key);
+	if (*key == '\0' || strpbrk(key, "=:[") != NULL) {
+		return -5;
+	}
+
+	if (!conf_insert_point(*start, section, section_len, &prev)) {
+		/* A new section, after a blank line */
+		for (prev = *start; prev != NULL && prev->next != NULL; prev = prev->next);
+		if (prev != NULL && prev->words != 0) {
+			prev = insert_text(start, prev, "");
+		}
+
+		text = (char *) MALLOC(section_len + 3);
+		(void) sprintf(text, "[%.*s]", (int) section_len, section);
+		prev = insert_text(start, prev, text);
+		FREE(text);
+	}
+
+	text = (char *) MALLOC(strlen(key) + strlen(conf->sep) + strlen(args) + 1);
+	(void) sprintf(text, "%s%s%s", key, conf->sep, args);
+	*lines = insert_text(start, prev, text);
+	FREE(text);
+
+	return 0;
+}
+
+/* 'unset [section.]key': deletes the line of key */
+int cmd_unset(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	struct line *line;
+
+	(void) fname;
+
+	if (*args == '\0' || strpbrk(args, " \t") != NULL) {
+		return -5;
+	}
+
+	line = conf_find(conf_ready(*start), args);
+	if (line == NULL) {
+		return -5;
+	}
+
+	*lines = delete_line(start, line);
+	return 0;
+}
+
+/* Background jobs: 'command &' forks, and the child runs the command on its copy-on-write snapshot of the
+ * buffers, with its output going to a file. If the command changed its buffer (or made a new one), the child
+ * writes the result out, and the parent takes it when the job is reaped: into the buffer as one undoable change
+ * if that hasn't been edited since the job started, otherwise into a new buffer, and says so.
+ */
+struct job {
+	int id;
+	pid_t pid;
+	char *command;
+	char *buffer; /* Name of the buffer the job started in */
+	unsigned long edit_count; /* Of that buffer, when the job started */
+	double started;
+	char out[32]; /* What the command printed */
+	char result[32]; /* The header line 'wrote changed<tab>buffer name', then the lines if changed */
+	struct job *next;
+};
+
+struct job *jobs;
+int job_ids;
+int in_job; /* In the child of a job */
+int job_wrote; /* The job wrote its buffer's file, the parent brings the undo sidecar up to date */
+unsigned long job_wrote_edits; /* The buffer's edit_count when it did */
+
+/* Whether 'line' holds 'text' (of length 'len', without a newline) */
+int line_is(struct line *line, const char *text, size_t len, char **buf, size_t *cap)
+{
+	return line->len == len + 1 && line->hash == hash_bytes(text, len) && memcmp(line_text(line, buf, cap), text, len) == 0;
+}
+
+/* Makes the current buffer hold the lines of the job's result in 'file' as one change, so 'u' takes the job back.
+ * Only the lines between the common start and end are replaced, so the rest keep their marks and the cursor stays.
+ */
+void job_apply(FILE *file)
+{
+	char **rows = NULL;
+	size_t *lens = NULL;
+	size_t cap = 0;
+	size_t m = 0;
+	size_t n;
+	size_t prefix;
+	size_t suffix;
+	size_t cursor;
+	struct line **gone;
+	struct line *last;
+	char *text = NULL;
+	size_t text_size;
+	char *buf = NULL;
+	size_t buf_cap = 0;
+	ssize_t len;
+	int moved;
+
+	while ((len = getline(&text, &text_size, file)) >= 0) {
+		HEAP_ADOPT(text, text_size);
+		if (m == cap) {
+			char **grown_rows;
+			size_t *grown_lens;
+
+			cap = cap == 0 ? 64 : cap * 2;
+			grown_rows = (char **) MALLOC(cap * sizeof(char *));
+			grown_lens = (size_t *) MALLOC(cap * sizeof(size_t));
+			if (m != 0) {
+				(void) memcpy(grown_rows, rows, m * sizeof(char *));
+				(void) memcpy(grown_lens, lens, m * sizeof(size_t));
+			}
+			FREE(rows);
+			FREE(lens);
+			rows = grown_rows;
+			lens = grown_lens;
+		}
+		rows[m] = text;
+		lens[m++] = len > 0 && text[len - 1] == '\n' ? (size_t) len - 1 : (size_t) len;
+		text = NULL;
+	}
+	free(text);
+
+	build_index(curbuf->start);
+	n = curbuf->index.count;
+	cursor = curbuf->lines != NULL ? curbuf->lines->number : 1;
+	for (prefix = 0; prefix < n && prefix < m &&
+			line_is(curbuf->index.lines[prefix], rows[prefix], lens[prefix], &buf, &buf_cap); prefix++);
+	for (suffix = 0; suffix < n - prefix && suffix < m - prefix &&
+			line_is(curbuf->index.lines[n - 1 - suffix], rows[m - 1 - suffix], lens[m - 1 - suffix], &buf, &buf_cap);
+			suffix++);
+
+	/* The index goes stale with the first delete, keep the lines to go */
+	gone = (struct line **) MALLOC((n - prefix - suffix + 1) * sizeof(struct line *));
+	(void) memcpy(gone, curbuf->index.lines + prefix, (n - prefix - suffix) * sizeof(struct line *));
+	last = prefix > 0 ? curbuf->index.lines[prefix - 1] : NULL;
+	moved = cursor > prefix && cursor <= n - suffix;
+
+	curbuf->undo.group_pending = 1;
+	for (size_t i = 0; i < n - prefix - suffix; i++) {
+		(void) delete_line(&curbuf->start, gone[i]);
+	}
+	for (size_t i = prefix; i < m - suffix; i++) {
+		rows[i][lens[i]] = '\0';
+		last = insert_text(&curbuf->start, last, rows[i]);
+	}
+
+	/* The cursor's line was replaced, stay at its number */
+	if (moved || curbuf->lines == NULL) {
+		build_index(curbuf->start);
+		cursor = cursor < curbuf->index.count ? cursor : curbuf->index.count;
+		curbuf->lines = cursor > 0 ? curbuf->index.lines[cursor - 1] : NULL;
+	}
+
+	for (size_t i = 0; i < m; i++) {
+		FREE(rows[i]);
+	}
+	FREE(rows);
+	FREE(lens);
+	FREE(gone);
+	FREE(buf);
+}
+
+/* Takes a finished job's result and prints what it printed, 'block' waits for it. Returns 1 if it finished. */
+int job_reap(struct job *job, int block)
+{
+	struct buffer *active = curbuf;
+	struct buffer *target;
+	struct line *last;
+	char name[4096];
+	char *text;
+	size_t text_size;
+	int applied;
+	int changed;
+	int wrote;
+	int status;
+	FILE *file;
+
+	if (waitpid(job->pid, &status, block ? 0 : WNOHANG) == 0) {
+		return 0;
+	}
+
+	(void) printf("[%d] %s (%.1fs): %s\n", job->id, WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "done" : "failed",
+			now() - job->started, job->command);
+
+	file = fopen(job->out, "r");
+	if (file != NULL) {
+		text = NULL;
+		while (getline(&text, &text_size, file) >= 0) {
+			(void) fputs(text, stdout);
+		}
+		free(text);
+		(void) fclose(file);
+	}
+
+	/* Only the header's own newline may go, the buffer's text starts right after it */
+	file = fopen(job->result, "r");
+	text = NULL;
+	if (file != NULL && getline(&text, &text_size, file) >= 0 &&
+			sscanf(text, "%d %d\t%4095[^\n]", &wrote, &changed, name) == 3) {
+		free(text);
+		target = buffer_find(name);
+
+		if (changed && target != NULL && strcmp(name, job->buffer) == 0 && target->edit_count != job->edit_count) {
+			/* The buffer moved on, keep both */
+			(void) snprintf(name + strlen(name), sizeof(name) - strlen(name), ".job%d", job->id);
+			(void) printf("[%d] @%s was edited since, the result is in @%s\n", job->id, job->buffer, name);
+			target = buffer_find(name);
+		}
+
+		applied = changed && target != NULL && strcmp(name, job->buffer) == 0;
+		if (applied) {
+			curbuf = target;
+			job_apply(file);
+		} else if (changed) {
+			/* A buffer the command made (or a conflict), replaced if it is there */
+			if (target != NULL) {
+				active = active == target ? NULL : active;
+				buffer_destroy(target);
+			}
+			target = buffer_new(name, NULL);
+			active = active == NULL ? target : active;
+			last = NULL;
+			text = NULL;
+			while (getline(&text, &text_size, file) >= 0) {
+				HEAP_ADOPT(text, text_size);
+				last = append_line(&target->start, last, text);
+				FREE(text);
+				text = NULL;
+			}
+			free(text);
+			target->lines = target->start;
+		}
+
+		/* The file holds the job's buffer: the result just applied, or if the job didn't change it, the buffer as it
+		 * was when the job started, which the history describes if it hasn't moved on
+		 */
+		if (wrote && target != NULL && target->fname != NULL &&
+				(applied || (!changed && target->edit_count == job->edit_count))) {
+			curbuf = target;
+			undo_persist(target->fname, &target->start);
+		}
+	} else {
+		free(text);
+	}
+	if (file != NULL) {
+		(void) fclose(file);
+	}
+
+	curbuf = active;
+	(void) unlink(job->out);
+	(void) unlink(job->result);
+	return 1;
+}
+
+void job_free(struct job *job)
+{
+	struct job **link;
+
+	for (link = &jobs; *link != job; link = &(*link)->next);
+	*link = job->next;
+
+	FREE(job->command);
+	FREE(job->buffer);
+	FREE(job);
+}
+
+/* Called after every line of input, takes the results of finished jobs */
+void jobs_reap()
+{
+	struct job *job;
+	struct job *next;
+
+	for (job = jobs; job != NULL; job = next) {
+		next = job->next;
+		if (job_reap(job, 0)) {
+			job_free(job);
+		}
+	}
+}
+
+/* The job with id 'args', or the most recent one if that is empty */
+struct job *job_find(const char *args)
+{
+	struct job *job;
+	char *end;
+	long id;
+
+	if (*args == '\0') {
+		for (job = jobs; job != NULL && job->next != NULL; job = job->next);
+		return job;
+	}
+
+	id = strtol(args + (*args == '%'), &end, 10);
+	if (*end != '\0') {
+		return NULL;
+	}
+
+	for (job = jobs; job != NULL && job->id != id; job = job->next);
+	return job;
+}
+
+/* 'jobs': lists the running jobs */
+int cmd_jobs(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	(void) fname;
+	(void) start;
+	(void) lines;
+
+	if (*args != '\0') {
+		return -5;
+	}
+
+	for (struct job *job = jobs; job != NULL; job = job->next) {
+		(void) printf("[%d] running %.1fs @%s: %s\n", job->id, now() - job->started, job->buffer, job->command);
+	}
+
+	return 0;
+}
+
+/* 'wait [n]': waits for job n (default the most recent) to finish and takes its result, 'wait all' for all of them */
+int cmd_wait(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	struct job *job;
+
+	(void) fname;
+	(void) start;
+	(void) lines;
+
+	if (strcmp(args, "all") == 0) {
+		while (jobs != NULL) {
+			(void) job_reap(jobs, 1);
+			job_free(jobs);
+		}
+		return 0;
+	}
+
+	job = job_find(args);
+	if (job == NULL) {
+		return -5;
+	}
+
+	(void) job_reap(job, 1);
+	job_free(job);
+	return 0;
+}
+
+/* 'kill [n]': stops job n (default the most recent), its result is thrown away */
+int cmd_kill(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	struct job *job;
+	int status;
+
+	(void) fname;
+	(void) start;
+	(void) lines;
+
+	job = job_find(args);
+	if (job == NULL) {
+		return -5;
+	}
+
+	(void) kill(job->pid, SIGKILL);
+	(void) waitpid(job->pid, &status, 0);
+	(void) printf("[%d] killed: %s\n", job->id, job->command);
+	(void) unlink(job->out);
+	(void) unlink(job->result);
+	job_free(job);
+	return 0;
+}
+
+void destroy_jobs()
+{
+	while (jobs != NULL) {
+		(void) cmd_kill(NULL, NULL, NULL, "");
+	}
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date */
+int64_t days_from_civil(int64_t y, int m, int d)
+{
+	int64_t era;
+	int64_t yoe;
+	int64_t doy;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/* 'n' digits at 's' */
+int parse_digits(const char *s, int n, int *value)
+{
+	*value = 0;
+	for (int i = 0; i < n; i++) {
+		if (!isdigit((unsigned char) s[i])) {
+			return 0;
+		}
+		*value = *value * 10 + (s[i] - '0');
+	}
+
+	return 1;
+}
+
+/* Parses a timestamp at the start of 's' into milliseconds since the epoch, fixed formats only:
+ * ISO-8601 'YYYY-MM-DD[T ]HH:MM:SS[.fff][Z|+hh:mm|-hh:mm]' (UTC unless an offset says otherwise), and
+ * syslog 'Mmm dd HH:MM:SS', which has no year, so it is taken to be this one. Returns the length parsed, 0 if none.
+ */
+size_t parse_timestamp(const char *s, size_t len, int64_t *ms)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	static int this_year;
+	int year, month, day, hour, minute, second;
+	int frac;
+	int digits;
+	int off_h;
+	int off_m;
+	size_t n;
+	time_t t;
+	struct tm tm;
+
+	if (len >= 19 && parse_digits(s, 4, &year) && s[4] == '-' && parse_digits(s + 5, 2, &month) && s[7] == '-' &&
+			parse_digits(s + 8, 2, &day) && (s[10] == 'T' || s[10] == ' ')) {
+		n = 11;
+	} else if (len >= 15 && s[3] == ' ' && (s[4] == ' ' || isdigit((unsigned char) s[4])) && isdigit((unsigned char) s[5]) &&
+			s[6] == ' ') {
+		const char *m = NULL;
+
+		for (int i = 0; i < 12; i++) {
+			if (strncmp(months + i * 3, s, 3) == 0) {
+				m = months + i * 3;
+			}
+		}
+		if (m == NULL) {
+			return 0;
+		}
+		month = (int) (m - months) / 3 + 1;
+		day = (s[4] == ' ' ? 0 : s[4] - '0') * 10 + s[5] - '0';
+
+		if (this_year == 0) {
+			t = time(NULL);
+			(void) gmtime_r(&t, &tm);
+			this_year = tm.tm_year + 1900;
+		}
+		year = this_year;
+		n = 7;
+	} else {
+		return 0;
+	}
+
+	if (n + 8 > len || !parse_digits(s + n, 2, &hour) || s[n + 2] != ':' || !parse_digits(s + n + 3, 2, &minute) ||
+			s[n + 5] != ':' || !parse_digits(s + n + 6, 2, &second) || month < 1 || month > 12 || day < 1 || day > 31) {
+		return 0;
+	}
+	n += 8;
+
+	frac = 0;
+	if (n < len && (s[n] == '.' || s[n] == ',')) {
+		for (n++, digits = 0; n < len && isdigit((unsigned char) s[n]); n++, digits++) {
+			if (digits < 3) {
+				frac = frac * 10 + (s[n] - '0');
+			}
+		}
+		for (; digits < 3; digits++) {
+			frac *= 10;
+		}
+	}
+
+	*ms = ((days_from_civil(year, month, day) * 24 + hour) * 60 + minute) * 60 + second;
+	if (n < len && s[n] == 'Z') {
+		n++;
+	} else if (n + 6 <= len && (s[n] == '+' || s[n] == '-') && parse_digits(s + n + 1, 2, &off_h) && s[n + 3] == ':' &&
+			parse_digits(s + n + 4, 2, &off_m)) {
+		*ms -= (s[n] == '+' ? 1 : -1) * (off_h * 3600 + off_m * 60);
+		n += 6;
+	}
+	*ms = *ms * 1000 + frac;
+
+	return n;
+}
+
+/* 'follow': one file being followed, read incrementally from where it was last time */
+struct follow_file {
+	const char *name;
+	int fd;
+	int wd; /* inotify watch */
+	off_t offset;
+	char *partial; /* A line without its newline yet */
+	size_t partial_len;
+	size_t partial_cap;
+	int64_t last_ts; /* Lines without a timestamp (continuations) sort with the line before them */
+};
+
+/* A line waiting in the reorder window, a min-heap on (timestamp, arrival) */
+struct follow_line {
+	int64_t ts;
+	uint64_t seq;
+	char *text;
+};
+
+struct follow_heap {
+	struct follow_line *lines;
+	size_t count;
+	size_t cap;
+};
+
+#define FOLLOW_WINDOW_LINES 65536
+
+int follow_before(struct follow_line *a, struct follow_line *b)
+{
+	return a->ts < b->ts || (a->ts == b->ts && a->seq < b->seq);
+}
+
+void follow_push(struct follow_heap *heap, struct follow_line line)
+{
+	struct follow_line *grown;
+	size_t i;
+
+	if (heap->count == heap->cap) {
+		heap->cap = heap->cap == 0 ? 256 : heap->cap * 2;
+		grown = (struct follow_line *) MALLOC(heap->cap * sizeof(struct follow_line));
+		if (heap->count != 0) {
+			(void) memcpy(grown, heap->lines, heap->count * sizeof(struct follow_line));
+		}
+		FREE(heap->lines);
+		heap->lines = grown;
+	}
+
+	for (i = heap->count++; i > 0 && follow_before(&line, &heap->lines[(i - 1) / 2]); i = (i - 1) / 2) {
+		heap->lines[i] = heap->lines[(i - 1) / 2];
+	}
+	heap->lines[i] = line;
+}
+
+struct follow_line follow_pop(struct follow_heap *heap)
+{
+	struct follow_line top = heap->lines[0];
+	struct follow_line last = heap->lines[--heap->count];
+	size_t i = 0;
+	size_t child;
+
+	for (; (child = 2 * i + 1) < heap->count; i = child) {
+		if (child + 1 < heap->count && follow_before(&heap->lines[child + 1], &heap->lines[child])) {
+			child++;
+		}
+		if (!follow_before(&heap->lines[child], &last)) {
+			break;
+		}
+		heap->lines[i] = heap->lines[child];
+	}
+	if (heap->count != 0) {
+		heap->lines[i] = last;
+	}
+
+	return top;
+}
+
+/* Reads what was appended to 'file' since last time, queueing each whole line */
+void follow_read(struct follow_file *file, struct follow_heap *heap, uint64_t *seq, int64_t *newest)
+{
+	char chunk[65536];
+	struct follow_line line;
+	struct stat st;
+	ssize_t got;
+	char *nl;
+	char *p;
+	size_t len;
+
+	/* Truncated (or rotated in place), start over */
+	if (fstat(file->fd, &st) == 0 && st.st_size < file->offset) {
+		file->offset = 0;
+		file->partial_len = 0;
+	}
+
+	while ((got = pread(file->fd, chunk, sizeof(chunk), file->offset)) > 0) {
+		file->offset += got;
+
+		for (p = chunk; p < chunk + got; p = nl + 1) {
+			nl = (char *) memchr(p, '\n', (size_t) (chunk + got - p));
+			len = (size_t) ((nl != NULL ? nl : chunk + got) - p);
+
+			if (file->partial_len + len + 1 > file->partial_cap) {
+				char *grown;
+
+				file->partial_cap = (file->partial_len + len + 1) * 2;
+				grown = (char *) MALLOC(file->partial_cap);
+				if (file->partial_len != 0) {
+					(void) memcpy(grown, file->partial, file->partial_len);
+				}
+				FREE(file->partial);
+				file->partial = grown;
+			}
+			(void) memcpy(file->partial + file->partial_len, p, len);
+			file->partial_len += len;
+
+			if (nl == NULL) {
+				break;
+			}
+
+			file->partial[file->partial_len] = '\0';
+			if (parse_timestamp(file->partial, file->partial_len, &line.ts) == 0) {
+				line.ts = file->last_ts;
+			}
+			file->last_ts = line.ts;
+			if (line.ts > *newest) {
+				*newest = line.ts;
+			}
+
+			line.seq = (*seq)++;
+			line.text = file->partial;
+			follow_push(heap, line);
+
+			file->partial = NULL;
+			file->partial_len = 0;
+			file->partial_cap = 0;
+		}
+	}
+}
+
+/* 'follow f1 f2 ...': follows growing files (like 'tail -f'), interleaving their new lines into the buffer
+ * "follow" by the timestamp they start with, until ctrl+c. Lines are held back for a reorder window of
+ * BLOB_FOLLOW_WINDOW seconds (default 1) of timestamps, or until the files have been quiet that long.
+ */
+int cmd_follow(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	struct follow_file files[64];
+	struct follow_heap heap;
+	struct follow_line line;
+	struct inotify_event *event;
+	struct buffer *out;
+	struct pollfd pfd;
+	struct line *last;
+	char events[4096];
+	const char *env;
+	int64_t window;
+	int64_t newest;
+	uint64_t seq;
+	double quiet;
+	size_t nfiles;
+	ssize_t got;
+	int notify;
+	char *tok;
+
+	(void) fname;
+	(void) start;
+	(void) lines;
+
+	env = getenv("BLOB_FOLLOW_WINDOW");
+	window = (int64_t) ((env != NULL ? strtod(env, NULL) : 1.0) * 1000);
+
+	notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (notify < 0) {
+		perror("ed: follow");
+		return -5;
+	}
+
+	nfiles = 0;
+	for (tok = strtok(args, " \t"); tok != NULL; tok = strtok(NULL, " \t")) {
+		if (nfiles == sizeof(files) / sizeof(files[0])) {
+			break;
+		}
+
+		(void) memset(&files[nfiles], 0, sizeof(files[nfiles]));
+		files[nfiles].name = tok;
+		files[nfiles].last_ts = INT64_MIN;
+		files[nfiles].fd = open(tok, O_RDONLY | O_CLOEXEC);
+		files[nfiles].wd = files[nfiles].fd >= 0 ? inotify_add_watch(notify, tok, IN_MODIFY) : -1;
+		if (files[nfiles].wd < 0) {
+			perror("ed: follow");
+			if (files[nfiles].fd >= 0) {
+				(void) close(files[nfiles].fd);
+			}
+			break;
+		}
+
+		/* Only what is appended from now on */
+		files[nfiles].offset = lseek(files[nfiles].fd, 0, SEEK_END);
+		nfiles++;
+	}
+
+	if (nfiles == 0 || tok != NULL) {
+		for (size_t i = 0; i < nfiles; i++) {
+			(void) close(files[i].fd);
+		}
+		(void) close(notify);
+		return -5;
+	}
+
+	out = buffer_find("follow");
+	if (out != NULL) {
+		buffer_destroy(out);
+	}
+	out = buffer_new("follow", NULL);
+
+	(void) memset(&heap, 0, sizeof(heap));
+	newest = INT64_MIN;
+	seq = 0;
+	last = NULL;
+	quiet = now();
+	pfd.fd = notify;
+	pfd.events = POLLIN;
+
+	stop_insertion = 0;
+	while (!stop_insertion || heap.count != 0) {
+		if (!stop_insertion && poll(&pfd, 1, 100) > 0) {
+			/* Which file changed doesn't matter much, reading one that didn't is a cheap pread() */
+			while ((got = read(notify, events, sizeof(events))) > 0) {
+				for (char *p = events; p < events + got; p += sizeof(struct inotify_event) + event->len) {
+					event = (struct inotify_event *) p;
+					for (size_t i = 0; i < nfiles; i++) {
+						if (files[i].wd == event->wd) {
+							follow_read(&files[i], &heap, &seq, &newest);
+						}
+					}
+				}
+			}
+			quiet = now();
+		}
+
+		/* Release what the window has passed: everything, once stopped or quiet for a whole window */
+		while (heap.count != 0 && (stop_insertion || heap.count > FOLLOW_WINDOW_LINES ||
+					now() - quiet >= window / 1000.0 || (newest != INT64_MIN && heap.lines[0].ts <= newest - window))) {
+			line = follow_pop(&heap);
+			last = append_line(&out->start, last, line.text);
+			print_line(last);
+			FREE(line.text);
+		}
+	}
+	stop_insertion = 0;
+
+	out->lines = last != NULL ? last : out->start;
+	for (size_t i = 0; i < nfiles; i++) {
+		(void) close(files[i].fd);
+		FREE(files[i].partial);
+	}
+	(void) close(notify);
+	FREE(heap.lines);
+
+	return 0;
+}
+
+#define TIMEHIST_MAX_BUCKETS 1000000
+
+/* What the workers of 'timehist' share: each line's timestamp, INT64_MIN if it has none */
+struct timehist {
+	regex_t re;
+	int anchored; /* No regex, the timestamp starts the line */
+	struct line **lines;
+	int64_t *ts;
+};
+
+void timehist_chunk(void *ctx, size_t begin, size_t end)
+{
+	struct timehist *th = (struct timehist *) ctx;
+	regmatch_t match[2];
+	const char *text;
+	size_t cap = 0;
+	char *buf = NULL;
+	size_t at;
+
+	for (size_t i = begin; i < end; i++) {
+		th->ts[i] = INT64_MIN;
+		text = line_text(th->lines[i], &buf, &cap);
+
+		if (th->anchored) {
+			(void) parse_timestamp(text, strlen(text), &th->ts[i]);
+			continue;
+		}
+
+		/* The timestamp starts where the regex (or its first group) matched, or right after it */
+		if (regexec(&th->re, text, 2, match, 0) != 0) {
+			continue;
+		}
+		if (match[1].rm_so >= 0) {
+			match[0] = match[1];
+		}
+		at = (size_t) match[0].rm_so;
+		if (parse_timestamp(text + at, strlen(text + at), &th->ts[i]) == 0) {
+			at = (size_t) match[0].rm_eo;
+			if (parse_timestamp(text + at, strlen(text + at), &th->ts[i]) == 0) {
+				th->ts[i] = INT64_MIN;
+			}
+		}
+	}
+
+	FREE(buf);
+}
+
+/* 'timehist [/re/] interval [> @name]': counts the lines per interval (like 30s, 1m, 1h or 1d) of the timestamp
+ * found where re (or its first group) matches or ends, default the start of the line, as a histogram or, with '> @name',
+ * a TSV buffer of 'bucket<tab>count'. Timestamps are ISO-8601 or syslog, see parse_timestamp().
+ */
+int cmd_timehist(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	char pattern[1024];
+	struct timehist th;
+	struct buffer *out;
+	struct line *last;
+	size_t *counts;
+	size_t nbuckets;
+	size_t unparsed;
+	size_t most;
+	size_t bar;
+	int64_t interval;
+	int64_t first;
+	int64_t latest;
+	char stamp[64];
+	char text[128];
+	char *name;
+	char *end;
+	time_t t;
+	struct tm tm;
+
+	(void) fname;
+	(void) lines;
+
+	(void) memset(&th, 0, sizeof(th));
+	th.anchored = 1;
+	if (*args == '/') {
+		if (parse_pattern(&args, pattern, sizeof(pattern)) < 0) {
+			return -5;
+		}
+		th.anchored = *pattern == '\0';
+		if (!th.anchored && regcomp(&th.re, pattern, 0) != 0) {
+			return -5;
+		}
+		while (*args == ' ' || *args == '\t') {
+			args++;
+		}
+	}
+
+	interval = strtoll(args, &end, 10);
+	switch (*end) {
+		case 's':; {interval *= 1000; break;}
+		case 'm':; {interval *= 60 * 1000; break;}
+		case 'h':; {interval *= 3600 * 1000; break;}
+		case 'd':; {interval *= 86400 * 1000; break;}
+		default:; {interval = 0; end--; break;}
+	}
+	for (end++; *end == ' ' || *end == '\t'; end++);
+
+	name = NULL;
+	if (*end == '>') {
+		for (end++; *end == ' ' || *end == '\t'; end++);
+		name = *end == '@' && end[1] != '\0' ? end + 1 : NULL;
+		if (name == NULL || strpbrk(name, " \t") != NULL || buffer_find(name) == curbuf) {
+			interval = 0;
+		}
+	} else if (*end != '\0') {
+		interval = 0;
+	}
+
+	if (interval <= 0) {
+		if (!th.anchored) {
+			regfree(&th.re);
+		}
+		return -5;
+	}
+
+	/* Parsing is the expensive part, do that in parallel and bucket the results after */
+	build_index(*start);
+	th.lines = curbuf->index.lines;
+	th.ts = (int64_t *) MALLOC((curbuf->index.count + 1) * sizeof(int64_t));
+	parallel_for(curbuf->index.count, 16384, timehist_chunk, &th);
+	if (!th.anchored) {
+		regfree(&th.re);
+	}
+
+	first = INT64_MAX;
+	latest = INT64_MIN;
+	unparsed = 0;
+	for (size_t i = 0; i < curbuf->index.count; i++) {
+		if (th.ts[i] == INT64_MIN) {
+			unparsed++;
+			continue;
+		}
+		first = th.ts[i] < first ? th.ts[i] : first;
+		latest = th.ts[i] > latest ? th.ts[i] : latest;
+	}
+
+	if (first > latest) {
+		FREE(th.ts);
+		(void) printf("no timestamps, %zu lines\n", unparsed);
+		return 0;
+	}
+
+	/* Buckets start at multiples of the interval, so 1m buckets start on the minute */
+	first -= ((first % interval) + interval) % interval;
+	if ((uint64_t) (latest - first) / (uint64_t) interval >= TIMEHIST_MAX_BUCKETS) {
+		FREE(th.ts);
+		return -5;
+	}
+	nbuckets = (size_t) ((latest - first) / interval) + 1;
+	counts = (size_t *) MALLOC(nbuckets * sizeof(size_t));
+	(void) memset(counts, 0, nbuckets * sizeof(size_t));
+	for (size_t i = 0; i < curbuf->index.count; i++) {
+		if (th.ts[i] != INT64_MIN) {
+			counts[(th.ts[i] - first) / interval]++;
+		}
+	}
+	FREE(th.ts);
+
+	out = NULL;
+	last = NULL;
+	if (name != NULL) {
+		out = buffer_find(name);
+		if (out != NULL) {
+			buffer_destroy(out);
+		}
+		out = buffer_new(name, NULL);
+	}
+
+	most = 0;
+	for (size_t i = 0; i < nbuckets; i++) {
+		most = counts[i] > most ? counts[i] : most;
+	}
+
+	for (size_t i = 0; i < nbuckets; i++) {
+		t = (time_t) ((first + (int64_t) i * interval) / 1000);
+		(void) gmtime_r(&t, &tm);
+		(void) strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+		if (name != NULL) {
+			(void) snprintf(text, sizeof(text), "%s\t%zu", stamp, counts[i]);
+			last = append_line(&out->start, last, text);
+			continue;
+		}
+
+		bar = (counts[i] * 40 + most - 1) / most;
+		(void) printf("%s %8zu ", stamp, counts[i]);
+		while (bar-- > 0) {
+			(void) putc('#', stdout);
+		}
+		(void) putc('\n', stdout);
+	}
+
+	if (name != NULL) {
+		out->lines = out->start;
+	} else if (unparsed != 0) {
+		(void) printf("%zu lines without a timestamp\n", unparsed);
+	}
+
+	FREE(counts);
+	return 0;
+}
+
+/* 'clone @name': copies the buffer into buffer name, which becomes current. The copy shares the text of every line
+ * (see share_line()), and the line index is copied along, so it costs a line header per line however long the lines are.
+ * Like join's results it has no file, unless name is a file's buffer: that one's lines are replaced, to adopt a clone.
+ */
+int cmd_clone(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	struct buffer *src = curbuf;
+	struct buffer *out;
+	struct line *line;
+	struct line *last;
+	char *adopt;
+	size_t count;
+
+	(void) fname;
+
+	if (*args != '@' || args[1] == '\0' || strpbrk(args, " \t") != NULL || strcmp(args + 1, src->name) == 0) {
+		return -5;
+	}
+
+	build_index(*start);
+
+	adopt = NULL;
+	out = buffer_find(args + 1);
+	if (out != NULL) {
+		if (out->fname != NULL) {
+			adopt = (char *) MALLOC(strlen(out->fname) + 1);
+			(void) strcpy(adopt, out->fname);
+		}
+		buffer_destroy(out);
+	}
+	out = buffer_new(args + 1, adopt);
+	FREE(adopt);
+
+	/* The file's history doesn't lead to these lines, start over (as 'recover' does), and checkpoint like buffer_open() */
+	if (out->fname != NULL) {
+		out->undo.loaded = 1;
+		out->undo.checked = 1;
+		out->undo.truncate_at = 0;
+		checkpoint_init(out->fname);
+	}
+
+	count = src->index.count;
+	out->index.count = count;
+	out->index.lines = (struct line **) MALLOC((count + 1) * sizeof(struct line *));
+	out->index.bytes = (size_t *) MALLOC((count + 1) * sizeof(size_t));
+	out->index.words = (size_t *) MALLOC((count + 1) * sizeof(size_t));
+	(void) memcpy(out->index.bytes, src->index.bytes, (count + 1) * sizeof(size_t));
+	(void) memcpy(out->index.words, src->index.words, (count + 1) * sizeof(size_t));
+
+	/* Shared lines keep their numbers, which the source's index just made valid */
+	last = NULL;
+	for (size_t i = 0; i < count; i++) {
+		line = share_line(src->index.lines[i]);
+		line->prev = last;
+		if (last != NULL) {
+			last->next = line;
+		} else {
+			out->start = line;
+		}
+		out->index.lines[i] = line;
+		last = line;
+	}
+
+	out->stats = src->stats;
+	out->index.valid = 1;
+	out->index.generation = ++index_generations;
+	input_cost.touched += count;
+
+	out->lines = *lines != NULL && count != 0 ? out->index.lines[(*lines)->number - 1] : out->start;
+	for (int i = 0; i < 26; i++) {
+		if (src->marks[i] != NULL) {
+			out->marks[i] = out->index.lines[src->marks[i]->number - 1];
+		}
 	}
 
-	return create_file;
+	return 0;
 }
 
-/* Read lines from file 'fname', store in dest */
-void read_lines(const char *fname, struct line **dest)
+int cmd_stats(const char *fname, struct line **start, struct line **lines, char *args);
+
+/* 'uniq': delete lines equal to the line before them */
+int cmd_uniq(const char *fname, struct line **start, struct line **lines, char *args)
 {
-	FILE *file;
+	struct line *line;
 
-	struct line *idx;
+	(void) fname;
 
-	char *current_line;
-	size_t line_size;
+	if (*args != '\0') {
+		return -5;
+	}
 
-	short lines_read;
+	line = *start;
+	while (line != NULL && line->next != NULL) {
+		if (!lines_equal(line, line->next)) {
+			line = line->next;
+			continue;
+		}
 
-	file = fopen(fname, "r");
-	if (file == NULL) {
-		/* No such file or directory */
-		if (errno == ENOENT) {
-			file = create_empty_file(fname);
-		} else {
-			perror("ed");
-			exit(EXIT_FAILURE);
+		if (*lines == line->next) {
+			*lines = line;
 		}
+		(void) delete_line(start, line->next);
 	}
 
-	*dest = ALLOC_LL(struct line);
-	(*dest)->prev = NULL;
-	(*dest)->next = NULL;
-	idx = *dest;
+	return 0;
+}
 
-	current_line = NULL;
-	lines_read = 0;
-	while (getline(&current_line, &line_size, file) != -1) {
-		charray_to_line(idx, current_line);
-		free(current_line);
-		APPEND_LL(idx);
-		idx = idx->next;
-		current_line = NULL;
+/* 'dedup': delete every line equal to an earlier one, keeping the first */
+int cmd_dedup(const char *fname, struct line **start, struct line **lines, char *args)
+{
+	struct line **seen;
+	struct line *line;
+	struct line *next;
+	size_t cap;
+	size_t slot;
 
-		if (lines_read == 0) {
-			lines_read = 1;
-		}
+	(void) fname;
+
+	if (*args != '\0') {
+		return -5;
 	}
 
-	free(current_line);
+	for (cap = 16; cap < curbuf->stats.lines * 2; cap *= 2);
+	seen = (struct line **) MALLOC(cap * sizeof(struct line *));
+	(void) memset(seen, 0, cap * sizeof(struct line *));
 
-	/* If no lines were read, empty buffer */
-	if (lines_read == 0) {
-		free(*dest);
-		*dest = NULL;
-		(void) fclose(file);
-		return ;
-	}
+	for (line = *start; line != NULL; line = next) {
+		next = line->next;
 
-	/* Allocated one extra line, get rid of it */
-	idx = idx->prev;
-	free(idx->next);
-	idx->next = NULL;
+		for (slot = line->hash & (cap - 1); seen[slot] != NULL; slot = (slot + 1) & (cap - 1)) {
+			if (lines_equal(seen[slot], line)) {
+				break;
+			}
+		}
 
-	(void) fclose(file);
+		if (seen[slot] == NULL) {
+			seen[slot] = line;
+			continue;
+		}
 
+		if (*lines == line) {
+			*lines = line->prev;
+		}
+		(void) delete_line(start, line);
+	}
+
+	FREE(seen);
+	return 0;
 }
 
-void print_chars(struct character *chars)
+#ifdef BLOB_HEAP_PROFILE
+/* 'heap [n]': top n allocation sites and live blocks */
+int cmd_heap(const char *fname, struct line **start, struct line **lines, char *args)
 {
-	while (chars != NULL) {
-		(void) putc((int) chars->c, stdout);
-		chars = chars->next;
-	}
+	(void) fname;
+	(void) start;
+	(void) lines;
+
+	heap_report(stdout, *args != '\0' ? strtoul(args, NULL, 10) : 10);
+	return 0;
 }
+#endif
 
-void print_line(struct line *line)
+typedef int (*command_fn)(const char *fname, struct line **start, struct line **lines, char *args);
+
+/* Commands with a name longer than one character, which take the rest of the input line as arguments */
+struct command {
+	const char *name;
+	command_fn run;
+	struct cmd_stats stats;
+};
+
+struct command commands[] = {
+	{"wc", cmd_wc, {0}},
+	{"stats", cmd_stats, {0}},
+	{"uniq", cmd_uniq, {0}},
+	{"dedup", cmd_dedup, {0}},
+	{"recover", cmd_recover, {0}},
+	{"buffers", cmd_buffers, {0}},
+	{"open", cmd_open, {0}},
+	{"rgrep", cmd_rgrep, {0}},
+	{"index", cmd_index, {0}},
+	{"key", cmd_key, {0}},
+	{"join", cmd_join, {0}},
+	{"get", cmd_get, {0}},
+	{"set", cmd_set, {0}},
+	{"unset", cmd_unset, {0}},
+	{"jobs", cmd_jobs, {0}},
+	{"wait", cmd_wait, {0}},
+	{"kill", cmd_kill, {0}},
+	{"follow", cmd_follow, {0}},
+	{"timehist", cmd_timehist, {0}},
+	{"clone", cmd_clone, {0}},
+#ifdef BLOB_HEAP_PROFILE
+	{"heap", cmd_heap, {0}},
+#endif
+	{NULL, NULL, {0}}
+};
+
+void print_cmd_stats(const char *name, struct cmd_stats *stats, int json, int *first)
 {
-	if (line != NULL) {
-		print_chars(line->data);
+	if (stats->runs == 0) {
+		return ;
 	}
-	(void) fputc('\n', stdout);
+
+	if (json) {
+		(void) printf("%s\n  {\"command\": \"%s\", \"runs\": %lu, \"seconds\": %.9f",
+				*first ? "" : ",", name, stats->runs, stats->seconds);
+		for (int i = 0; i < PERF_COUNTERS; i++) {
+			if (perf_fds[i] >= 0) {
+				(void) printf(", \"%s\": %llu", perf_names[i], (unsigned long long) stats->counters[i]);
+			}
+		}
+		(void) fputs("}", stdout);
+	} else {
+		(void) printf("%-8s %8lu %12.3f %12.3f", name, stats->runs,
+				stats->seconds * 1e3, stats->seconds * 1e3 / (double) stats->runs);
+		for (int i = 0; i < PERF_COUNTERS; i++) {
+			if (perf_fds[i] >= 0) {
+				(void) printf(" %14llu", (unsigned long long) (stats->counters[i] / stats->runs));
+			} else if (perf_enabled) {
+				(void) printf(" %14s", "-");
+			}
+		}
+		(void) putc('\n', stdout);
+	}
+
+	*first = 0;
 }
 
-void destroy_chars(struct character *chars)
+/* 'stats [json]': per command type run counts, wall clock time and averaged counters */
+int cmd_stats(const char *fname, struct line **start, struct line **lines, char *args)
 {
-	struct character *tmp;
+	char name[2];
+	int json;
+	int first;
 
-	while (chars != NULL) {
-		tmp = chars->next;
-		free(chars);
-		chars = tmp;
+	(void) fname;
+	(void) start;
+	(void) lines;
+
+	json = strcmp(args, "json") == 0;
+	if (!json && *args != '\0') {
+		return -5;
 	}
-}
 
-void destroy_line(struct line *line)
-{
-	destroy_chars(line->data);
-	free(line);
-}
+	if (json) {
+		(void) fputs("[", stdout);
+	} else {
+		(void) printf("simd: %s\n", simd_names[simd_level]);
+		(void) printf("zones: %zu, %zu KB, %zu lines skipped\n", curbuf->zones.count,
+				curbuf->zones.count * sizeof(struct zone) / 1024, curbuf->zones.skipped);
+		if (curbuf->fields.active && curbuf->fields.json_key != NULL) {
+			(void) printf("fields: key %s", curbuf->fields.json_key);
+		} else if (curbuf->fields.active) {
+			(void) printf("fields: field %d of '%c'", curbuf->fields.field, curbuf->fields.delim);
+		} else {
+			(void) fputs("fields: none", stdout);
+		}
+		(void) printf(", %zu blocks, %zu KB, %zu hits, %zu misses\n", curbuf->fields.count,
+				curbuf->fields.count * sizeof(struct field_block) / 1024, curbuf->fields.hits, curbuf->fields.misses);
+		(void) printf("%-8s %8s %12s %12s", "command", "runs", "total_ms", "avg_ms");
+		for (int i = 0; perf_enabled && i < PERF_COUNTERS; i++) {
+			(void) printf(" %14s", perf_names[i]);
+		}
+		(void) putc('\n', stdout);
+	}
 
-void destroy_lines(struct line *lines)
-{
-	struct line *tmp;
+	first = 1;
+	name[1] = '\0';
+	for (int c = 0; c < 256; c++) {
+		name[0] = (char) c;
+		print_cmd_stats(name, &char_stats[c], json, &first);
+	}
 
-	while (lines != NULL) {
-		tmp = lines->next;
-		destroy_line(lines);
-		lines = tmp;
+	for (struct command *cmd = commands; cmd->name != NULL; cmd++) {
+		print_cmd_stats(cmd->name, &cmd->stats, json, &first);
+	}
+
+	if (json) {
+		(void) fputs("\n]\n", stdout);
 	}
+
+	return 0;
 }
 
-/* Writes lines to handle/stream */
-void lines_to_handle(FILE *file, struct line *lines)
+/* Looks up a named command at the start of 's', 'args' is set to its (newline stripped) arguments */
+struct command *find_command(char *s, char **args)
 {
-	char *line;
+	struct command *cmd;
+	size_t name_len;
 
-	while (lines != NULL) {
-		line = lines_to_charray(lines);
+	name_len = strcspn(s, " \t\n");
+	for (cmd = commands; cmd->name != NULL; cmd++) {
+		if (strlen(cmd->name) != name_len || strncmp(cmd->name, s, name_len) != 0) {
+			continue;
+		}
 
-		(void) fprintf(file, "%s", line);
+		s += name_len;
+		while (*s == ' ' || *s == '\t') {
+			s++;
+		}
+		s[strcspn(s, "\n")] = '\0';
 
-		free(line);
-		lines = lines->next;
+		*args = s;
+		return cmd;
 	}
+
+	return NULL;
 }
 
-void write_lines(const char *fname, struct line *lines)
+/* Runs a single character command */
+int run_instruction(const char *fname, struct line **start, struct line **lines, char c)
 {
-	FILE *file = fopen(fname, "w");
+	switch (c) {
+		case 'n':; { /* Next line */
+			if (*lines == NULL) {
+				return -1;
+			}
 
-	if (file == NULL) {
-		perror("ed");
-		exit(EXIT_FAILURE);
+			if ((*lines)->next == NULL) {
+				return -1;
+			} else {
+				(*lines) = (*lines)->next;
+				input_cost.touched++;
+			}
+			break;
+		}
+		case 'b':; { /* Back one line */
+			if (*lines == NULL) {
+				return -2;
+			}
+
+			if ((*lines)->prev == NULL) {
+				return -2;
+			} else {
+				(*lines) = (*lines)->prev;
+				input_cost.touched++;
+			}
+			break;
+		}
+		case 'p':; {print_line(*lines); break;} /* Print current line */
+		case 'i':; { /* Insert lines until user does (ctrl+c) */
+			insert_line(start, lines);
+			break;
+		}
+		case 'l':; { /* List contents of the buffer */
+			lines_to_handle(stdout, *start);
+			break;
+		}
+		case 'd':; {*lines = delete_line(start, *lines); break;} /* Delete the current line */
+		case 'q':; {return -3;} /* Quit Blob */
+		case 'w':; { /* Write buffer to the file */
+			if (fname == NULL) {
+				return -5;
+			}
+			write_lines(fname, *start);
+			/* A job's parent does this once it has the job's result */
+			if (in_job) {
+				job_wrote = 1;
+				job_wrote_edits = curbuf->edit_count;
+			} else {
+				undo_persist(fname, start);
+			}
+			checkpoint_remove(fname);
+			break;
+		}
+		case 'u':; {return undo_last(fname, start, lines);} /* Undo the last change */
+		case 'h':; {usage(); break;} /* Print usage message */
+		default:; {return 1;} /* Not a command, skipped */
 	}
 
-	lines_to_handle(file, lines);
-	(void) fclose(file);
+	return 0;
 }
 
-void insert_line(struct line **start, struct line **line)
+/* Runs a line of input from the user */
+int run_instructions(const char *fname, struct line **start, struct line **lines, char *s)
 {
-	struct line *new_line;
-	char *buffer;
-	size_t buffer_size;
+	struct command *cmd;
+	struct sample sample;
+	double parse_started;
+	char *args;
+	int ret;
 
-	stop_insertion = 0;
-	while (!stop_insertion) {
-		new_line = ALLOC_LL(struct line);
+	parse_started = now();
+	cmd = find_command(s, &args);
+	input_cost.parse += now() - parse_started;
 
-		buffer = NULL;
-		if (getline(&buffer, &buffer_size, stdin) < 0) {
-			/* getline() man page says to free() buffer even if error occured */
-			free(buffer);
-			exit(EXIT_FAILURE);
+	/* '@name' switches buffers, '@a & @b' (or |, -) is a set operation */
+	if (cmd == NULL && *s == '@') {
+		s[strcspn(s, "\n")] = '\0';
+		if (strpbrk(s, " \t") != NULL) {
+			return set_operation(s);
 		}
-
-		/* Even if (ctrl+c) is hit, we won't know, if we are waiting for input */
-		if (stop_insertion) {
-			free(buffer);
-			free(new_line); /* No use of destroy_line() b/c there is no character ll inside */
-			break;
+		if (buffer_find(s + 1) == NULL) {
+			return -5;
 		}
+		curbuf = buffer_find(s + 1);
+		return 0;
+	}
 
-		charray_to_line(new_line, buffer);
-		free(buffer);
-
-		/* Nothing in the buffer */
-		if (*line == NULL) {
-			new_line->next = NULL;
-			new_line->prev = NULL;
-			*line = new_line;
-			*start = *line;
+	if (cmd != NULL) {
+		sample_begin(&sample);
+		ret = cmd->run(fname, start, lines, args);
+		sample_end(&sample, &cmd->stats);
+		return ret;
+	}
+
+	ret = run_address(start, lines, &s);
+	if (ret != 0) {
+		return ret;
+	}
+
+	for (; *s != '\n' && *s != '\0'; s++) {
+		/* 'kx' marks the current line as x */
+		if (*s == 'k') {
+			if (*lines == NULL || !islower((unsigned char) s[1])) {
+				return -5;
+			}
+			curbuf->marks[s[1] - 'a'] = *lines;
+			s++;
 			continue;
 		}
 
-		new_line->next = (*line)->next;
-		new_line->prev = (*line);
+		sample_begin(&sample);
+		ret = run_instruction(fname, start, lines, *s);
+		if (ret == 1) {
+			continue;
+		}
 
-		if ((*line)->next != NULL) {
-			(*line)->next->prev = new_line;
+		sample_end(&sample, &char_stats[(unsigned char) *s]);
+		if (ret != 0) {
+			return ret;
 		}
+	}
+
+	return 0;
+}
 
+/* Reads the slow command log settings: BLOB_SLOW_LOG (path), BLOB_SLOW_MS and BLOB_SLOW_LOG_SIZE (bytes) */
+void slow_log_init()
+{
+	const char *env;
 
-		(*line)->next = new_line;
-		*line = new_line;
+	slow_log_path = getenv("BLOB_SLOW_LOG");
+	if (slow_log_path != NULL && *slow_log_path == '\0') {
+		slow_log_path = NULL;
+	}
+
+	env = getenv("BLOB_SLOW_MS");
+	if (env != NULL) {
+		slow_threshold = strtod(env, NULL) / 1e3;
+	}
+
+	env = getenv("BLOB_SLOW_LOG_SIZE");
+	if (env != NULL) {
+		slow_log_max = strtol(env, NULL, 10);
 	}
 }
 
-struct line *delete_line(struct line **start, struct line *line)
+/* Appends an entry for 'text' if it took longer than the threshold, rotating the log to '<path>.1' when full */
+void slow_log(const char *text, double started)
 {
-	struct line *ret;
+	char rotated[4096];
+	char stamp[32];
+	double latency;
+	FILE *log;
+	time_t t;
 
-	if (line == NULL) {
-		return NULL;
+	latency = now() - started - input_cost.wait;
+	if (slow_log_path == NULL || latency < slow_threshold) {
+		return ;
 	}
 
-	/* If first line, move the start of the buffer to the next line */
-	if (*start == line) {
-		*start = line->next;
+	log = fopen(slow_log_path, "a");
+	if (log == NULL) {
+		perror("ed: slow log");
+		slow_log_path = NULL;
+		return ;
 	}
 
-	if (line->next != NULL) {
-		ret = line->next;
-		line->next->prev = line->prev;
+	if (ftell(log) >= slow_log_max) {
+		(void) fclose(log);
+		(void) snprintf(rotated, sizeof(rotated), "%s.1", slow_log_path);
+		(void) rename(slow_log_path, rotated);
+		log = fopen(slow_log_path, "a");
+		if (log == NULL) {
+			perror("ed: slow log");
+			slow_log_path = NULL;
+			return ;
+		}
 	}
 
-	if (line->prev != NULL) {
-		ret = line->prev;
-		line->prev->next = line->next;
+	t = time(NULL);
+	(void) strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+
+	(void) fprintf(log, "%s latency_ms=%.3f buffer_lines=%zu buffer_bytes=%zu touched=%zu"
+			" parse_ms=%.3f exec_ms=%.3f io_ms=%.3f",
+			stamp, latency * 1e3, curbuf->stats.lines, curbuf->stats.bytes, input_cost.touched,
+			input_cost.parse * 1e3, (latency - input_cost.parse - input_cost.io) * 1e3, input_cost.io * 1e3);
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		if (perf_fds[i] >= 0) {
+			(void) fprintf(log, " %s=%llu", perf_names[i], (unsigned long long) input_cost.counters.counters[i]);
+		}
 	}
+	(void) fprintf(log, " command=\"%.*s\"\n", (int) strcspn(text, "\n"), text);
 
-	/* Last line of the file, buffer will be empty */
-	if (line->next == NULL && line->prev == NULL) {
-		ret = NULL;
+	(void) fclose(log);
+}
+
+/* Writes the child's result: whether it wrote the file and changed the buffer, and the buffer if it did */
+void job_result(const char *path, struct buffer *started_in, unsigned long edit_count)
+{
+	char *buf = NULL;
+	size_t cap = 0;
+	int changed;
+	FILE *file;
+
+	changed = curbuf != started_in || curbuf->edit_count != edit_count;
+
+	file = fopen(path, "w");
+	if (file == NULL) {
+		_exit(EXIT_FAILURE);
 	}
 
-	destroy_line(line);
+	/* Edits after the write leave a file the result doesn't match, the sidecar can't describe it */
+	(void) fprintf(file, "%d %d\t%s\n", job_wrote && curbuf->edit_count == job_wrote_edits, changed, curbuf->name);
+	for (struct line *line = changed ? curbuf->start : NULL; line != NULL; line = line->next) {
+		(void) fprintf(file, "%s\n", line_text(line, &buf, &cap));
+	}
 
-	return ret;
+	if (fclose(file) != 0) {
+		_exit(EXIT_FAILURE);
+	}
 }
 
-/* Runs a line of input from the user */
-int run_instructions(const char *fname, struct line **start, struct line **lines, char *s)
+/* Runs 'input', which ended in '&', as a background job */
+int job_start(char *input)
 {
-	for (; *s != '\n' && *s != '\0'; s++) {
-		switch (*s) {
-			case 'n':; { /* Next line */
-				if (*lines == NULL) {
-					return -1;
-				}
+	struct buffer *started_in;
+	unsigned long edit_count;
+	struct job *job;
+	struct job **tail;
+	char *end;
+	int out;
+	int result;
+	int null;
+	pid_t pid;
+	int ret;
 
-				if ((*lines)->next == NULL) {
-					return -1;
-				} else {
-					(*lines) = (*lines)->next;
-				}
-				break;
-			}
-			case 'b':; { /* Back one line */
-				if (*lines == NULL) {
-					return -2;
-				}
+	/* Drop the '&' */
+	end = strrchr(input, '&');
+	*end = '\0';
+	while (end > input && isspace((unsigned char) end[-1])) {
+		*--end = '\0';
+	}
+	if (*input == '\0') {
+		return -5;
+	}
 
-				if ((*lines)->prev == NULL) {
-					return -2;
-				} else {
-					(*lines) = (*lines)->prev;
-				}
-				break;
-			}
-			case 'p':; {print_line(*lines); break;} /* Print current line */
-			case 'i':; { /* Insert lines until user does (ctrl+c) */
-				insert_line(start, lines);
-				break;
-			}
-			case 'l':; { /* List contents of the buffer */
-				lines_to_handle(stdout, *start);
-				break;
-			}
-			case 'd':; {*lines = delete_line(start, *lines); break;} /* Delete the current line */
-			case 'q':; {return -3;} /* Quit Blob */
-			case 'w':; {write_lines(fname, *start); break;} /* Write buffer to the file */
-			case 'h':; {usage(); break;} /* Print usage message */
-			default:; {continue;}
+	job = ALLOC_LL(struct job);
+	(void) memset(job, 0, sizeof(*job));
+	(void) strcpy(job->out, "/tmp/blob-job-XXXXXX");
+	(void) strcpy(job->result, "/tmp/blob-job-XXXXXX");
+	out = mkstemp(job->out);
+	result = out >= 0 ? mkstemp(job->result) : -1;
+	if (result < 0) {
+		perror("ed: job");
+		if (out >= 0) {
+			(void) close(out);
+			(void) unlink(job->out);
+		}
+		FREE(job);
+		return -5;
+	}
+	(void) close(result);
+
+	(void) fflush(stdout);
+	(void) fflush(stderr);
+	pid = fork();
+	if (pid < 0) {
+		perror("ed: job");
+		(void) close(out);
+		(void) unlink(job->out);
+		(void) unlink(job->result);
+		FREE(job);
+		return -5;
+	}
+
+	if (pid == 0) {
+		/* Checkpoints and other jobs are the parent's business */
+		in_job = 1;
+		for (struct buffer *b = buffers; b != NULL; b = b->next) {
+			b->checkpoint.child = 0;
+			b->checkpoint.interval = 0;
 		}
+
+		null = open("/dev/null", O_RDONLY);
+		if (null >= 0) {
+			(void) dup2(null, STDIN_FILENO);
+		}
+		(void) dup2(out, STDOUT_FILENO);
+		(void) dup2(out, STDERR_FILENO);
+
+		started_in = curbuf;
+		edit_count = curbuf->edit_count;
+		curbuf->undo.group_pending = 1;
+		ret = run_instructions(curbuf->fname, &curbuf->start, &curbuf->lines, input);
+		if (ret == -4 && curbuf->fname != NULL) {
+			write_lines(curbuf->fname, curbuf->start);
+			job_wrote = 1;
+			job_wrote_edits = curbuf->edit_count;
+		} else if (ret == -5) {
+			(void) puts("?");
+		}
+
+		(void) fflush(stdout);
+		job_result(job->result, started_in, edit_count);
+		_exit(ret == -5 ? EXIT_FAILURE : EXIT_SUCCESS);
 	}
 
+	(void) close(out);
+	job->id = ++job_ids;
+	job->pid = pid;
+	job->started = now();
+	job->edit_count = curbuf->edit_count;
+	job->command = (char *) MALLOC(strlen(input) + 1);
+	(void) strcpy(job->command, input);
+	job->buffer = (char *) MALLOC(strlen(curbuf->name) + 1);
+	(void) strcpy(job->buffer, curbuf->name);
+
+	for (tail = &jobs; *tail != NULL; tail = &(*tail)->next);
+	*tail = job;
+
+	(void) printf("[%d] %d\n", job->id, (int) pid);
 	return 0;
 }
 
@@ -421,12 +7008,15 @@ void remove_last_char(char **s)
 int main(int argc, char **argv)
 {
 	const char *FILE_NAME = (const char *) argv[1];
-	struct line *lines;
-	struct line *start;
+	struct buffer *active;
+	struct buffer *b;
 	
 	char *input;
 	size_t input_size;
 	ssize_t getline_ret;
+	double started;
+	size_t len;
+	int ret;
 
 	if (argc != 2) {
 		usage();
@@ -434,35 +7024,69 @@ int main(int argc, char **argv)
 	}
 
 	handle_signals();
+	perf_init();
+	simd_init();
+	slow_log_init();
 
 	remove_last_char(&argv[1]);
 	
-	read_lines(FILE_NAME, &lines);
-	start = lines;
+	(void) buffer_open(FILE_NAME);
 
 	input = NULL;
 	for (;;) {
 		(void) fputs(PROMPT, stdout);
 		getline_ret = getline(&input, &input_size, stdin);
 		if (getline_ret < 0) {
-			destroy_lines(start);
+			destroy_lines(curbuf->start);
 			free(input);
 			exit(EXIT_FAILURE);
 		}
+		HEAP_ADOPT(input, input_size);
 
-		switch (run_instructions(FILE_NAME, &start, &lines, input)) {
+		(void) memset(&input_cost, 0, sizeof(input_cost));
+		started = now();
+		curbuf->undo.group_pending = 1;
+		len = strlen(input);
+		while (len > 0 && isspace((unsigned char) input[len - 1])) {
+			len--;
+		}
+		/* Like a shell, only a separate '&' starts a job, so values ending in '&' don't */
+		if (len > 1 && input[len - 1] == '&' && isspace((unsigned char) input[len - 2])) {
+			ret = job_start(input);
+		} else {
+			ret = run_instructions(curbuf->fname, &curbuf->start, &curbuf->lines, input);
+		}
+		slow_log(input, started);
+		jobs_reap();
+
+		active = curbuf;
+		for (b = buffers; b != NULL; b = b->next) {
+			if (b->fname != NULL) {
+				curbuf = b;
+				checkpoint_maybe(b->fname, b->start);
+			}
+		}
+		curbuf = active;
+
+		switch (ret) {
 			case -1:; {(void) fputs("EOF", stdout); break;}
 			case -2:; {(void) fputs("START", stdout); break;}
 			case -3:; {goto end;}
-			case -4:; {write_lines(FILE_NAME, start); break;}
+			case -4:; {write_lines(curbuf->fname, curbuf->start); break;}
+			case -5:; {(void) fputs("?", stdout); break;}
 		}
 
-		free(input);
+		FREE(input);
 		input = NULL;
 	}
 
 end:
-	destroy_lines(start);
-	free(input);
+	destroy_jobs();
+	while (buffers != NULL) {
+		buffer_destroy(buffers);
+	}
+	destroy_search_cache();
+	destroy_plugins();
+	FREE(input);
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,46 @@
+#ifndef BLOB_PLUGIN_H
+#define BLOB_PLUGIN_H
+
+/* Filter plugins for Blob, run with 'a,b plug name args'.
+ *
+ * A plugin is a shared object (name.so, looked up along BLOB_PLUGIN_PATH, default '.') that exports
+ *
+ *	const struct blob_plugin *blob_plugin(void);
+ *
+ * Blob hands 'filter' the range in batches of read-only line views, from several threads at once, and the
+ * plugin answers with edits to lines of the batch. Lines it says nothing about are kept as they are.
+ * Views (and the batch) are only valid during the call, text passed to 'replace' is copied.
+ *
+ * Build one with: cc -shared -fPIC -o name.so name.c
+ */
+
+#include <stddef.h>
+
+/* Bumped when anything below changes incompatibly, Blob refuses plugins built against another version */
+#define BLOB_PLUGIN_ABI 1
+
+struct blob_view {
+	const char *text; /* Not nul-terminated, without the newline */
+	size_t len;
+};
+
+struct blob_edits {
+	/* Replaces line 'index' (of the batch) with 'text' */
+	void (*replace)(struct blob_edits *edits, size_t index, const char *text, size_t len);
+	/* Deletes line 'index' (of the batch) */
+	void (*remove)(struct blob_edits *edits, size_t index);
+	void *host; /* Blob's, not for plugins */
+};
+
+struct blob_plugin {
+	int abi; /* BLOB_PLUGIN_ABI */
+	const char *name;
+	/* Optional. Called once per 'plug', sets the state passed to 'filter' and 'fini'. Returns 0, or -1 on error. */
+	int (*init)(const char *args, void **state);
+	/* Called concurrently on different batches, so it must not change 'state'. Returns 0, or -1 on error. */
+	int (*filter)(void *state, const struct blob_view *lines, size_t count, struct blob_edits *edits);
+	/* Optional */
+	void (*fini)(void *state);
+};
+
+#endif
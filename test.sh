@@ -0,0 +1,113 @@
+#!/bin/sh
+# Regression tests: runs commands through Blob's batch mode (commands on stdin)
+# on a small file, and checks what it wrote to the file or printed.
+#
+# Usage: ./test.sh
+
+BLOB=${BLOB:-./blob}
+
+if [ ! -x "$BLOB" ]; then
+	echo "test: $BLOB not found, run make first" >&2
+	exit 1
+fi
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+failed=0
+
+# run <contents> <commands>: runs the commands on a fresh file holding the contents
+run() {
+	rm -f "$DIR"/.file.*
+	printf '%s' "$1" > "$DIR/file"
+	printf '%s\nq\nq\n' "$2" | "$BLOB" "$DIR/file" 2>/dev/null
+}
+
+# again <commands>: runs more commands on the file the last run left
+again() {
+	printf '%s\nq\nq\n' "$1" | "$BLOB" "$DIR/file" 2>/dev/null
+}
+
+# check <name> <expected> <actual>
+check() {
+	if [ "$2" = "$3" ]; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1"
+		printf 'expected:\n%s\nactual:\n%s\n' "$2" "$3"
+		failed=1
+	fi
+}
+
+# written <name> <contents> <commands, ending in 'w'> <expected contents>
+written() {
+	run "$2" "$3" >/dev/null
+	# 'w' pads every line with a space, that isn't what is tested here
+	check "$1" "$4" "$(sed 's/ $//' "$DIR/file")"
+}
+
+# printed <name> <contents> <commands> <expected output, without the prompts>
+printed() {
+	check "$1" "$4" "$(run "$2" "$3" | sed 's/: //g')"
+}
+
+printed "conf: get after reverse" '[a]
+x=1
+[b]
+x=2
+' 'get a.x
+,reverse
+get a.x
+get b.x' '1
+?1'
+
+written "conf: set after reverse" '[a]
+x=1
+[b]
+x=2
+' 'get b.x
+,reverse
+set b.x 5
+w' 'x=2
+[b]
+x=5
+[a]'
+
+written "job: leading blank and indented lines" 'b
+
+  indented
+a
+' '1d &
+wait
+w' '
+  indented
+a'
+
+written "job: '&' ending a value isn't a job" 'url=x
+' 'set url http://h/?a=1&
+w' 'url=http://h/?a=1&'
+
+run 'a
+b
+c
+' '1dw &
+wait' >/dev/null
+again 'u
+w' >/dev/null
+# Every session pads the lines once more
+check "job: background write undone after reopening" 'a
+b
+c' "$(sed 's/ *$//' "$DIR/file")"
+
+written "job: marks kept" '1
+2
+3
+4
+' '2
+kx
+3d &
+wait
+'"'"'xd
+w' '1
+4'
+
+exit $failed